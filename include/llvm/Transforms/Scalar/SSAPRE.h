@@ -17,16 +17,28 @@
 
 #include "llvm/Analysis/TargetLibraryInfo.h"
 #include "llvm/Analysis/AssumptionCache.h"
+#include "llvm/ADT/Hashing.h"
 #include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/iterator_range.h"
 #include "llvm/IR/PassManager.h"
 #include "llvm/IR/Dominators.h"
 #include "llvm/ADT/PostOrderIterator.h"
 #include "llvm/Support/ArrayRecycler.h"
 #include "llvm/Support/Allocator.h"
 #include <stack>
+#include <vector>
 
 namespace llvm {
 
+class BlockFrequencyInfo;
+class Loop;
+class MemoryAccess;
+class MemorySSA;
+class MemorySSAWalker;
+class OptimizationRemarkEmitter;
+class TargetTransformInfo;
+
 namespace ssapre LLVM_LIBRARY_VISIBILITY {
 
 class SSAPRELegacy;
@@ -52,11 +64,10 @@ enum ExpressionType {
   ET_BasicStart,
   ET_Basic,
   ET_Phi,
-  // TODO later
-  // ET_Call,
-  // ET_AggregateValue,
-  // ET_Load,
-  // ET_Store,
+  ET_Load,
+  ET_Store,
+  ET_Call,
+  ET_AggregateValue,
   ET_BasicEnd
 
 };
@@ -69,6 +80,10 @@ inline std::string ExpressionTypeToString(ExpressionType ET) {
   case ET_Unknown:   return "ExpressionTypeUnknown";
   case ET_Basic:     return "ExpressionTypeBasic";
   case ET_Phi:       return "ExpressionTypePhi";
+  case ET_Load:      return "ExpressionTypeLoad";
+  case ET_Store:     return "ExpressionTypeStore";
+  case ET_Call:      return "ExpressionTypeCall";
+  case ET_AggregateValue: return "ExpressionTypeAggregateValue";
   case ET_Factor:    return "ExpressionTypeFactor";
   case ET_Variable:  return "ExpressionTypeVariable";
   case ET_Constant:  return "ExpressionTypeConstant";
@@ -90,42 +105,63 @@ enum VersionRanges : ExpVersion_t {
   VR_IgnoredHi  = -9999,
 };
 
+// Dense Expression IDs, the sentinels have fixed ones and the rest are handed
+// out sequentially per function
+enum ExpressionIDs : unsigned {
+  EID_Top = 0,
+  EID_Bottom = 1,
+  EID_First = 2,
+  EID_Unset = ~0U,
+};
+
 class Expression {
 private:
   ExpressionType EType;
   unsigned Opcode;
   ExpVersion_t Version;
 
-  Instruction *Proto;
+  // Index into the ID-keyed side tables
+  unsigned ID;
+
+  // A Prototype refers to its first occurrence, it is only read for operands
+  // and type and cloned when we need to insert a new computation
+  const Instruction *Proto;
 
   int Saved;
 
 public:
   Expression(ExpressionType ET = ET_Base, unsigned O = ~2U,
-             ExpVersion_t V = VR_Unset)
-      : EType(ET), Opcode(O), Version(V),
+             ExpVersion_t V = VR_Unset, unsigned ID = EID_Unset)
+      : EType(ET), Opcode(O), Version(V), ID(ID),
         Proto(nullptr),
         Saved(0) {}
   Expression(const Expression &) = delete;
   Expression &operator=(const Expression &) = delete;
   virtual ~Expression();
 
+  // The Top and Bottom sentinels are shared by all the runs, so none of the
+  // setters may touch them
+  bool isSentinel() const { return ID == EID_Top || ID == EID_Bottom; }
+
   unsigned getOpcode() const { return Opcode; }
-  void setOpcode(unsigned opcode) { Opcode = opcode; }
+  void setOpcode(unsigned opcode) { assert(!isSentinel()); Opcode = opcode; }
   ExpressionType getExpressionType() const { return EType; }
 
   ExpVersion_t getVersion() const { return Version; }
-  void setVersion(ExpVersion_t V) { Version = V; }
+  void setVersion(ExpVersion_t V) { assert(!isSentinel()); Version = V; }
+
+  unsigned getID() const { return ID; }
+  void setID(unsigned I) { assert(!isSentinel()); ID = I; }
 
-  Instruction * getProto() const { return Proto; }
-  void setProto(Instruction *I) { Proto = I; }
+  const Instruction * getProto() const { return Proto; }
+  void setProto(const Instruction *I) { assert(!isSentinel()); Proto = I; }
 
   bool getSave() const { return Saved > 0; }
-  void setSave(int S) { Saved = S; }
-  void clrSave() { Saved = 0; }
-  void remSave() { Saved--; }
-  void addSave() { Saved++; }
-  void addSave(int S) { Saved += S; }
+  void setSave(int S) { assert(!isSentinel()); Saved = S; }
+  void clrSave() { assert(!isSentinel()); Saved = 0; }
+  void remSave() { assert(!isSentinel()); Saved--; }
+  void addSave() { assert(!isSentinel()); Saved++; }
+  void addSave(int S) { assert(!isSentinel()); Saved += S; }
 
   static unsigned getEmptyKey() { return ~0U; }
   static unsigned getTombstoneKey() { return ~1U; }
@@ -155,6 +191,10 @@ public:
     return false;
   }
 
+  virtual hash_code getHashValue() const {
+    return hash_combine(getExpressionType(), getOpcode(), getVersion());
+  }
+
   virtual void printInternal(raw_ostream &OS) const {
     OS << ExpressionTypeToString(getExpressionType());
     OS << ", V: " << Version;
@@ -194,6 +234,10 @@ public:
     return false;
   }
 
+  hash_code getHashValue() const override {
+    return hash_combine(this->Expression::getHashValue(), Inst);
+  }
+
   void printInternal(raw_ostream &OS) const override {
     this->Expression::printInternal(OS);
   }
@@ -236,6 +280,10 @@ public:
     return false;
   }
 
+  hash_code getHashValue() const override {
+    return hash_combine(getExpressionType(), &VariableValue);
+  }
+
   void printInternal(raw_ostream &OS) const override {
     this->Expression::printInternal(OS);
     OS << ", V: " << VariableValue;
@@ -266,6 +314,10 @@ public:
     return false;
   }
 
+  hash_code getHashValue() const override {
+    return hash_combine(getExpressionType(), &ConstantValue);
+  }
+
   void printInternal(raw_ostream &OS) const override {
     this->Expression::printInternal(OS);
     OS << ", C:" << ConstantValue;
@@ -321,6 +373,11 @@ public:
     return false;
   }
 
+  hash_code getHashValue() const override {
+    return hash_combine(this->Expression::getHashValue(), ValueType,
+                        hash_combine_range(Operands.begin(), Operands.end()));
+  }
+
   void printInternal(raw_ostream &OS) const override {
     this->Expression::printInternal(OS);
     OS << ", OPS: " << getNumOperands();
@@ -365,6 +422,10 @@ public:
     return false;
   }
 
+  hash_code getHashValue() const override {
+    return hash_combine(this->BasicExpression::getHashValue(), BB);
+  }
+
   void printInternal(raw_ostream &OS) const override {
     this->BasicExpression::printInternal(OS);
     OS << ", BB: ";
@@ -372,6 +433,159 @@ public:
   }
 }; // class PHIExpression
 
+class LoadExpression final : public BasicExpression {
+private:
+  // The clobbering MemorySSA access. It is not a part of the identity, loads
+  // and stores of the same address share a Proto, and the memory state acts
+  // as an extra operand that Rename versions them by: the access defines it,
+  // a MemoryPhi alters it like a PHI of an operand and calls for a Factor.
+  const MemoryAccess *MemDef;
+
+public:
+  LoadExpression(const MemoryAccess *MA)
+    : BasicExpression(ET_Load), MemDef(MA) {}
+  LoadExpression() = delete;
+  LoadExpression(const LoadExpression &) = delete;
+  LoadExpression &operator=(const LoadExpression &) = delete;
+  ~LoadExpression() override;
+
+  const MemoryAccess *getMemDef() const { return MemDef; }
+
+  static bool classof(const Expression *EB) {
+    return EB->getExpressionType() == ET_Load;
+  }
+
+  void printInternal(raw_ostream &OS) const override {
+    this->BasicExpression::printInternal(OS);
+    OS << ", MD: " << (const void *)MemDef;
+  }
+}; // class LoadExpression
+
+class StoreExpression final : public BasicExpression {
+private:
+  // The store's own MemoryDef. A store is an occurrence of the load that would
+  // read the stored value back, i.e. of the load Proto of its address, its
+  // operands and type are set up accordingly. It always starts a new version.
+  const MemoryAccess *MemDef;
+
+public:
+  StoreExpression(const MemoryAccess *MA)
+    : BasicExpression(ET_Store), MemDef(MA) {}
+  StoreExpression() = delete;
+  StoreExpression(const StoreExpression &) = delete;
+  StoreExpression &operator=(const StoreExpression &) = delete;
+  ~StoreExpression() override;
+
+  const MemoryAccess *getMemDef() const { return MemDef; }
+
+  static bool classof(const Expression *EB) {
+    return EB->getExpressionType() == ET_Store;
+  }
+
+  bool equals(const Expression &O) const override {
+    if (!this->BasicExpression::equals(O))
+      return false;
+    if (auto OE = dyn_cast<StoreExpression>(&O)) {
+      return MemDef == OE->MemDef;
+    }
+    return false;
+  }
+
+  hash_code getHashValue() const override {
+    return hash_combine(this->BasicExpression::getHashValue(), MemDef);
+  }
+
+  void printInternal(raw_ostream &OS) const override {
+    this->BasicExpression::printInternal(OS);
+    OS << ", MD: " << (const void *)MemDef;
+  }
+}; // class StoreExpression
+
+class CallExpression final : public BasicExpression {
+private:
+  // The clobbering MemorySSA access for the readonly calls, treated the same
+  // way as for the loads. The readnone ones do not depend on memory at all.
+  const MemoryAccess *MemDef;
+  bool ReadsMemory;
+
+public:
+  CallExpression(const MemoryAccess *MA, bool RM)
+    : BasicExpression(ET_Call), MemDef(MA), ReadsMemory(RM) {}
+  CallExpression() = delete;
+  CallExpression(const CallExpression &) = delete;
+  CallExpression &operator=(const CallExpression &) = delete;
+  ~CallExpression() override;
+
+  const MemoryAccess *getMemDef() const { return MemDef; }
+  bool getReadsMemory() const { return ReadsMemory; }
+
+  static bool classof(const Expression *EB) {
+    return EB->getExpressionType() == ET_Call;
+  }
+
+  bool equals(const Expression &O) const override {
+    if (!this->BasicExpression::equals(O))
+      return false;
+    if (auto OE = dyn_cast<CallExpression>(&O)) {
+      return MemDef == OE->MemDef && ReadsMemory == OE->ReadsMemory;
+    }
+    return false;
+  }
+
+  hash_code getHashValue() const override {
+    return hash_combine(this->BasicExpression::getHashValue(), MemDef,
+                        ReadsMemory);
+  }
+
+  void printInternal(raw_ostream &OS) const override {
+    this->BasicExpression::printInternal(OS);
+    if (ReadsMemory) OS << ", MD: " << (const void *)MemDef;
+  }
+}; // class CallExpression
+
+class AggregateValueExpression final : public BasicExpression {
+private:
+  // Extracts or inserts of different fields of the same aggregate are
+  // different expressions
+  SmallVector<unsigned, 2> Indices;
+
+public:
+  AggregateValueExpression(ArrayRef<unsigned> Idxs)
+    : BasicExpression(ET_AggregateValue),
+      Indices(Idxs.begin(), Idxs.end()) {}
+  AggregateValueExpression() = delete;
+  AggregateValueExpression(const AggregateValueExpression &) = delete;
+  AggregateValueExpression &
+  operator=(const AggregateValueExpression &) = delete;
+  ~AggregateValueExpression() override;
+
+  ArrayRef<unsigned> getIndices() const { return Indices; }
+
+  static bool classof(const Expression *EB) {
+    return EB->getExpressionType() == ET_AggregateValue;
+  }
+
+  bool equals(const Expression &O) const override {
+    if (!this->BasicExpression::equals(O))
+      return false;
+    if (auto OE = dyn_cast<AggregateValueExpression>(&O)) {
+      return Indices == OE->Indices;
+    }
+    return false;
+  }
+
+  hash_code getHashValue() const override {
+    return hash_combine(this->BasicExpression::getHashValue(),
+                        hash_combine_range(Indices.begin(), Indices.end()));
+  }
+
+  void printInternal(raw_ostream &OS) const override {
+    this->BasicExpression::printInternal(OS);
+    OS << ", IDX:";
+    for (auto I : Indices) OS << " " << I;
+  }
+}; // class AggregateValueExpression
+
 class FactorExpression final : public Expression {
 private:
   const BasicBlock &BB;
@@ -380,40 +594,55 @@ private:
   // Proto
   const Expression *PE;
 
-  // This maps BB to Index inside Versions and HRU
-  SmallPtrSet<BasicBlock *, 4> Blocks;
-  DenseMap<BasicBlock *, size_t> Pred;
-  DenseMap<size_t, BasicBlock *> Indices;
+public:
+  // A single Factor operand, there is one per unique predecessor in the order
+  // they were added. Multiple edges from the same predecessor are folded into
+  // its multiplicity.
+  struct Operand {
+    BasicBlock *Pred;
+
+    // The Versioned Expression that this Factor joins along this edge
+    Expression *VExpr;
+
+    // Number of CFG edges from the predecessor
+    unsigned Mult : 30;
+
+    // If True this Factor merges init value and calculated value inside a
+    // cycle. These must be treated differently since with all formal
+    // predicates calculated this Factor/PHI will be replaced with the actual
+    // computation, but instead it should be pushed up to the init block. And if
+    // it happens that the Factor is not a Cycle, we still will push calculation
+    // to the init block since any constant/variable is regarded as bottom. This
+    // of course add register pressure
+    //
+    // The second course of actions would be to push the computation directly
+    // to the first use place, but we need to prove that this place is not
+    // inside a cycle, or at least in the same cycle as init.
+    unsigned Cycle : 1;
+
+    // True if an Operand is a Real expression and not Factor or Expression
+    // Operand definition(⊥)
+    unsigned HasRealUse : 1;
+
+    static BasicBlock *getPred(const Operand &O) { return O.Pred; }
+    static Expression *getVExpr(const Operand &O) { return O.VExpr; }
+  };
 
-  DenseMap<BasicBlock *, size_t> PredMult;
-  size_t TotalPredecessors;
+  typedef mapped_iterator<const Operand *, BasicBlock *(*)(const Operand &)>
+          pred_iterator;
+  typedef mapped_iterator<const Operand *, Expression *(*)(const Operand &)>
+          vexpr_iterator;
 
-  // The Versioned Expressions that this Factor joins
-  SmallVector<Expression *, 8> Versions;
+private:
+  SmallVector<Operand, 4> Operands;
+  size_t TotalPredecessors;
 
   // If True this Factor is linked to already existing PHI function
   bool Materialized;
 
-  // If True this Factor merges init value and calculated value inside a cycle.
-  // These must be treated differently since with all formal predicates
-  // calculated this Factor/PHI will be replaced with the actual computation,
-  // but instead it should be pushed up to the init block. And if it happens
-  // that the Factor is not a Cycle, we still will push calculation to the init
-  // block since any constant/variable is regarded as bottom. This of course
-  // add register pressure
-  //
-  // The second course of actions would be to push the computation directly to
-  // the first use place, but we need to prove that this place is not inside a
-  // cycle, or at least in the same cycle as init.
-  SmallVector<bool, 8> Cycles;
-
   // If True expression is Anticipated on every path leading from this Factor
   bool DownSafe;
 
-  // True if an Operand is a Real expression and not Factor or Expression
-  // Operand definition(⊥)
-  SmallVector<bool, 8> HasRealUse;
-
   bool CanBeAvail;
   bool Later;
 
@@ -434,66 +663,83 @@ public:
   bool getIsMaterialized() const { return Materialized; }
 
   bool getAnyCycles() const {
-    for (auto C : Cycles) {
-      if (C) return true;
+    for (auto &O : Operands) {
+      if (O.Cycle) return true;
     }
     return false;
   }
   bool getIsCycle(Expression *E) const {
     assert(E && hasVExpr(E));
-    return Cycles[getVExprIndex(E)];
+    return Operands[getVExprIndex(E)].Cycle;
   }
   void setIsCycle(Expression *E, bool CYC) {
     assert(E && hasVExpr(E));
-    Cycles[getVExprIndex(E)] = CYC;
+    Operands[getVExprIndex(E)].Cycle = CYC;
   }
 
   void setPExpr(const Expression *E) { PE = E; }
   const Expression* getPExpr() const { return PE; }
 
-  void addPred(BasicBlock *B, size_t I) {
+  void addPred(BasicBlock *B) {
     // Even if there are multiple edges from the same predecessor we store only
     // once
     TotalPredecessors++;
 
-    if (Pred.count(B)) {
-      PredMult[B]++;
+    auto I = getPredIndex(B);
+    if (I != -1UL) {
+      Operands[I].Mult++;
       return;
     }
 
-    Pred[B] = I;
-    PredMult[B] = 1;
-    Indices[I] = B;
-    Blocks.insert(B);
-    Versions.push_back(nullptr);
-    Cycles.push_back(false);
-    HasRealUse.push_back(false);
+    Operands.push_back({B, nullptr, 1, false, false});
   }
 
   size_t GetPredMult(BasicBlock * B) {
     assert(B);
-    return PredMult[B];
+    auto I = getPredIndex(B);
+    return I != -1UL ? Operands[I].Mult : 0;
+  }
+
+  iterator_range<pred_iterator> getPreds() const {
+    return make_range(pred_iterator(Operands.begin(), Operand::getPred),
+                      pred_iterator(Operands.end(), Operand::getPred));
   }
 
-  const SmallPtrSet<BasicBlock *, 4> &getPreds() { return Blocks; }
+  size_t getPredIndex(const BasicBlock *B) const {
+    for (size_t i = 0, l = Operands.size(); i < l; ++i) {
+      if (Operands[i].Pred == B)
+        return i;
+    }
+    return -1;
+  }
 
-  void setVExpr(BasicBlock *B, Expression * V) { Versions[Pred[B]] = V; }
+  void setVExpr(BasicBlock *B, Expression * V) {
+    auto I = getPredIndex(B);
+    assert(I != -1UL && "Not a predecessor");
+    Operands[I].VExpr = V;
+  }
 
   void replaceVExpr(Expression *E, Expression *V) {
     assert(hasVExpr(E));
-    Versions[getVExprIndex(E)] = V;
+    Operands[getVExprIndex(E)].VExpr = V;
   }
 
   bool hasVExpr(const Expression *V) const { return getVExprIndex(V) != -1UL; }
-  SmallVector<Expression *, 8> &getVExprs() { return Versions; };
-  Expression * getVExpr(BasicBlock *B) const { return Versions[Pred.lookup(B)]; }
+  iterator_range<vexpr_iterator> getVExprs() const {
+    return make_range(vexpr_iterator(Operands.begin(), Operand::getVExpr),
+                      vexpr_iterator(Operands.end(), Operand::getVExpr));
+  }
+  Expression * getVExpr(BasicBlock *B) const {
+    auto I = getPredIndex(B);
+    return I != -1UL ? Operands[I].VExpr : nullptr;
+  }
 
-  size_t getVExprNum() const { return Versions.size(); }
+  size_t getVExprNum() const { return Operands.size(); }
   size_t getTotalPredecessors() const { return TotalPredecessors; }
   size_t getVExprIndex(const Expression *V) const  {
     assert(V);
-    for(size_t i = 0, l = Versions.size(); i < l; ++i) {
-      if (Versions[i] == V)
+    for(size_t i = 0, l = Operands.size(); i < l; ++i) {
+      if (Operands[i].VExpr == V)
         return i;
     }
     return -1;
@@ -513,13 +759,17 @@ public:
 
   bool getWillBeAvail() const { return CanBeAvail && !Later; }
 
-  bool getHasRealUse(Expression *E) const {
-    assert(E && hasVExpr(E));
-    return HasRealUse[getVExprIndex(E)];
+  // Kept per predecessor, the same operand may come from several of them with
+  // a real use on some of the edges only
+  bool getHasRealUse(const BasicBlock *B) const {
+    auto I = getPredIndex(B);
+    assert(I != -1UL && "Not a predecessor");
+    return Operands[I].HasRealUse;
   }
-  void setHasRealUse(Expression *E, bool HRU) {
-    assert(E && hasVExpr(E));
-    HasRealUse[getVExprIndex(E)] = HRU;
+  void setHasRealUse(const BasicBlock *B, bool HRU) {
+    auto I = getPredIndex(B);
+    assert(I != -1UL && "Not a predecessor");
+    Operands[I].HasRealUse = HRU;
   }
 
   static bool classof(const Expression *EB) {
@@ -536,6 +786,10 @@ public:
     return false;
   }
 
+  hash_code getHashValue() const override {
+    return hash_combine(this->Expression::getHashValue(), &BB);
+  }
+
   void printInternal(raw_ostream &OS) const override {
     this->Expression::printInternal(OS);
     OS << ", BB: ";
@@ -547,23 +801,22 @@ public:
     OS << ", L: " << (Later ? "T" : "F");
     OS << ", WBA: " << (getWillBeAvail() ? "T" : "F");
     OS << ", CYC: <";
-    for (unsigned i = 0, l = Cycles.size(); i < l; ++i) {
-      OS << (Cycles[i] ? "T" : "F");
+    for (unsigned i = 0, l = Operands.size(); i < l; ++i) {
+      OS << (Operands[i].Cycle ? "T" : "F");
       if (i + 1 != l) OS << ",";
     }
     OS << ">";
     OS << ", HRU: <";
-    for (unsigned i = 0, l = HasRealUse.size(); i < l; ++i) {
-      OS << (HasRealUse[i] ? "T" : "F");
+    for (unsigned i = 0, l = Operands.size(); i < l; ++i) {
+      OS << (Operands[i].HasRealUse ? "T" : "F");
       if (i + 1 != l) OS << ",";
     }
     OS << ">";
     OS << ", V: {";
-    for (unsigned i = 0, l = Versions.size(); i < l; ++i) {
-      auto B = Indices.lookup(i);
-      B->printAsOperand(dbgs());
+    for (unsigned i = 0, l = Operands.size(); i < l; ++i) {
+      Operands[i].Pred->printAsOperand(dbgs());
       OS << ":";
-      auto VE = getVExpr(B);
+      auto VE = Operands[i].VExpr;
       if (VE) {
         if (VE->getVersion() == VR_Bottom) {
           OS << "⊥";
@@ -585,36 +838,182 @@ public:
   }
 }; // class FactorExpression
 
+// Structural hashing of Expressions, it is used to intern prototypes so that
+// equal expressions share the same one. Plain pointer keyed maps are still
+// used everywhere else.
+struct ExpressionHashInfo {
+  static const Expression *getEmptyKey() {
+    auto Val = static_cast<uintptr_t>(-1);
+    Val <<= PointerLikeTypeTraits<const Expression *>::NumLowBitsAvailable;
+    return reinterpret_cast<const Expression *>(Val);
+  }
+  static const Expression *getTombstoneKey() {
+    auto Val = static_cast<uintptr_t>(~1U);
+    Val <<= PointerLikeTypeTraits<const Expression *>::NumLowBitsAvailable;
+    return reinterpret_cast<const Expression *>(Val);
+  }
+  static unsigned getHashValue(const Expression *E) {
+    return static_cast<unsigned>(E->getHashValue());
+  }
+  static bool isEqual(const Expression *LHS, const Expression *RHS) {
+    if (LHS == RHS)
+      return true;
+    if (LHS == getTombstoneKey() || RHS == getTombstoneKey() ||
+        LHS == getEmptyKey() || RHS == getEmptyKey())
+      return false;
+    return *LHS == *RHS;
+  }
+};
+
+// Side table keyed by the dense Expression ID. It mimics the part of the
+// DenseMap interface we use, but the lookups are plain vector indexing. Absent
+// entries have a null key and read as default constructed values.
+template <typename ValueT> class ExpressionMap {
+public:
+  struct Entry : std::pair<const Expression *, ValueT> {
+    const Expression *getFirst() const { return this->first; }
+    ValueT &getSecond() { return this->second; }
+    const ValueT &getSecond() const { return this->second; }
+  };
+
+  // The iterator keeps an index rather than a pointer, so the table may grow
+  // while we walk it. Entries added past the end are not visited.
+  class iterator
+      : public iterator_facade_base<iterator, std::forward_iterator_tag,
+                                    Entry> {
+    std::vector<Entry> *Entries;
+    size_t Idx;
+
+    void skipEmpty() {
+      while (Idx < Entries->size() && !(*Entries)[Idx].first) ++Idx;
+    }
+
+  public:
+    iterator(std::vector<Entry> *E, size_t I) : Entries(E), Idx(I) {
+      skipEmpty();
+    }
+
+    bool operator==(const iterator &O) const { return Idx == O.Idx; }
+    Entry &operator*() const { return (*Entries)[Idx]; }
+    iterator &operator++() {
+      ++Idx;
+      skipEmpty();
+      return *this;
+    }
+  };
+
+private:
+  std::vector<Entry> Entries;
+  size_t NumEntries = 0;
+
+public:
+  ValueT &operator[](const Expression *E) {
+    assert(E && "Null Expression key");
+    auto ID = E->getID();
+    assert(ID != EID_Unset && "Expression has no ID");
+    if (ID >= Entries.size()) Entries.resize(ID + 1);
+    auto &En = Entries[ID];
+    if (!En.first) NumEntries++;
+    En.first = E;
+    return En.second;
+  }
+
+  ValueT lookup(const Expression *E) const {
+    if (!E) return ValueT();
+    auto ID = E->getID();
+    if (ID >= Entries.size() || !Entries[ID].first) return ValueT();
+    return Entries[ID].second;
+  }
+
+  size_t count(const Expression *E) const {
+    return E && E->getID() < Entries.size() && Entries[E->getID()].first;
+  }
+
+  bool insert(const std::pair<const Expression *, ValueT> &KV) {
+    if (count(KV.first)) return false;
+    (*this)[KV.first] = KV.second;
+    return true;
+  }
+
+  void erase(const Expression *E) {
+    if (!count(E)) return;
+    Entries[E->getID()] = Entry();
+    NumEntries--;
+  }
+
+  size_t size() const { return NumEntries; }
+
+  void clear() {
+    Entries.clear();
+    NumEntries = 0;
+  }
+
+  size_t getMemorySize() const { return Entries.capacity() * sizeof(Entry); }
+
+  iterator begin() { return iterator(&Entries, 0); }
+  iterator end() { return iterator(&Entries, Entries.size()); }
+};
+
 } // end namespace ssapre
 
 using namespace ssapre;
 
 typedef SmallVector<BasicBlock *, 32> BBVector_t;
 typedef SmallVector<FactorExpression *, 32> FEVector_t;
+typedef SmallVector<FactorExpression *, 4> FactorVector_t;
 typedef std::pair<unsigned, Expression *> UIntExpressionPair_t;
 typedef std::stack<UIntExpressionPair_t> ExprStack_t;
 typedef SmallVector<Expression *, 32> ExpVector_t;
 typedef DenseMap<const Expression *, ExprStack_t> PExprToVExprStack_t;
+typedef DenseMap<const Expression *, Expression *, ExpressionHashInfo>
+        PExprTable_t;
 
-/// Performs SSA PRE pass.
-class SSAPRE : public PassInfoMixin<SSAPRE> {
+namespace ssapre LLVM_LIBRARY_VISIBILITY {
+/// The state of a single SSAPRE run over a function. Nothing in here outlives
+/// the run, so no state carries over from one function to the next. This does
+/// not make the pass safe to run on several functions concurrently: it
+/// creates constants, inserts instructions and replaces uses, all of which
+/// edit use lists shared across functions, and MemoryVersioning walks the
+/// users of global addresses.
+class SSAPREContext {
   const DataLayout *DL;
   const TargetLibraryInfo *TLI;
+  const TargetTransformInfo *TTI;
   AssumptionCache *AC;
   DominatorTree *DT;
+  MemorySSA *MSSA;
+  MemorySSAWalker *MSSAWalker;
+  OptimizationRemarkEmitter *ORE;
+
+  // The memory state at the end of the blocks looked up so far
+  DenseMap<const BasicBlock *, MemoryAccess *> MemoryStateAtEnd;
+
+  // Only set in the profile guided mode
+  BlockFrequencyInfo *BFI;
   Function *Func;
   ReversePostOrderTraversal<Function *> *RPOT;
 
+  // Set if the function is over the block budget, no Factors are inserted then
+  // and only the dominated occurrences are replaced
+  bool FullRedundancyOnly;
+
   BumpPtrAllocator ExpressionAllocator;
 
+  // The largest the expression memory got after a step, for this function
+  // alone, it is merged into the statistic shared by all contexts at the end
+  size_t PeakMemory;
+
   ExpVersion_t LastVariableVersion;
   ExpVersion_t LastConstantVersion;
   ExpVersion_t LastIgnoredVersion;
 
+  // Next free dense Expression ID
+  unsigned LastExpressionID;
+
   SmallVector<const BasicBlock *, 32> JoinBlocks;
 
   // Values' stuff
-  DenseMap<Expression *, const Value *> ExpToValue;
+  ExpressionMap<Value *> ExpToValue;
   DenseMap<const Value *, Expression *> ValueToExp;
 
   // Arguments' stuff
@@ -626,7 +1025,19 @@ class SSAPRE : public PassInfoMixin<SSAPRE> {
   DenseMap<ConstantExpression *, Value *> COExpToValue;
   DenseMap<const Value *, ConstantExpression *> ValueToCOExp;
 
-  DenseMap<const FactorExpression *, const PHINode *> FactorToPHI;
+  // Factors made DownSafe by speculation
+  SmallPtrSet<const FactorExpression *, 8> SpeculatedFactors;
+
+  // Estimated number of values live into a block, per register class. Index 0
+  // is for scalars, 1 for vectors.
+  DenseMap<const BasicBlock *, unsigned> LiveIns[2];
+  // Blocks and uses walked for the estimate, it counts against
+  // -ssapre-max-pressure-work and not the budget of the core steps
+  uint64_t PressureWork;
+  // Factors that would keep too many values live if made available
+  SmallPtrSet<const FactorExpression *, 8> PressureLimited;
+
+  ExpressionMap<const PHINode *> FactorToPHI;
   DenseMap<const PHINode *, const FactorExpression *> PHIToFactor;
 
   // DFS info.
@@ -637,44 +1048,68 @@ class SSAPRE : public PassInfoMixin<SSAPRE> {
   InstrToOrderType InstrDFS;
   InstrToOrderType InstrSDFS;
 
-  // Instruction-to-Expression map
-  DenseMap<const Instruction *, Expression *> InstToVExpr;
-  DenseMap<const Expression *, Instruction *> VExprToInst;
+  // Dense instruction IDs, the DFS numbers have gaps for the inserted code and
+  // shift on SetOrderBefore. The IDs follow the same DT walk, so the phases
+  // walking it in order count them instead of looking them up, the inserted
+  // instructions get theirs appended. An Instruction has no room to keep its
+  // ID, so a lookup by pointer, i.e. GetVExpr/SetVExpr, still goes through
+  // this hash table.
+  InstrToOrderType InstrID;
+
+  // Instruction-to-Expression map, indexed by InstrID
+  std::vector<Expression *> InstToVExpr;
+  ExpressionMap<Instruction *> VExprToInst;
+
+  // Interned ProtoExpressions, structurally equal expressions share the same
+  // ProtoExpression
+  PExprTable_t PExprTable;
 
   // ProtoExpression-to-Instructions map
-  DenseMap<const Expression *, SmallPtrSet<const Instruction *, 5>> PExprToInsts;
+  ExpressionMap<SmallPtrSet<const Instruction *, 5>> PExprToInsts;
 
   // ProtoExpression-to-VersionedExpressions
-  DenseMap<const Expression *, SmallPtrSet<Expression *, 5>> PExprToVExprs;
+  ExpressionMap<SmallPtrSet<Expression *, 5>> PExprToVExprs;
 
-  DenseMap<const Expression *, DenseMap<int,ExpVector_t>> PExprToVersions;
+  // ProtoExpression-to-Versions-to-VersionedExpressions
+  ExpressionMap<DenseMap<int,ExpVector_t>> PExprToVersions;
 
   // ProtoExpression-to-BasicBlock map
-  DenseMap<const Expression *, SmallPtrSet<BasicBlock *, 5>> PExprToBlocks;
+  ExpressionMap<SmallPtrSet<BasicBlock *, 5>> PExprToBlocks;
 
   // BasicBlock-to-FactorList map
   DenseMap<const BasicBlock *, SmallVector<FactorExpression *, 5>> BlockToFactors;
-  DenseMap<const FactorExpression *, const BasicBlock *> FactorToBlock;
+  ExpressionMap<const BasicBlock *> FactorToBlock;
 
   // VersionedExpression-to-ProtoVersioned
-  DenseMap<const Expression *, const Expression *> ExprToPExpr;
+  ExpressionMap<const Expression *> ExprToPExpr;
 
   SmallPtrSet<FactorExpression *, 32> FExprs;
 
-  typedef DenseMap<Expression *, Expression *> ExpExpMap;
-  DenseMap<const Expression *, ExpExpMap> Substitutions;
+  // Factor-to-UsingFactors map, the reverse of the Factor graph
+  DenseMap<const FactorExpression *, FactorVector_t> FactorUsers;
+
+  // Direct substitution links, an Expression maps onto its immediate substitute.
+  // Keys are unique across prototypes, so a single flat table serves them all.
+  ExpressionMap<Expression *> Substitutions;
+
+  // Union-find forest over the direct links. A parent is either the direct
+  // link or, once the path is compressed, the root of the chain. Sentinels,
+  // variables, constants and self-substituted expressions are the roots.
+  ExpressionMap<Expression *> SubstitutionParents;
+
+  // The reverse of the direct links. Rewriting a link that is not a root resets
+  // the parents in its subtree to their direct links. An expression relinked
+  // elsewhere leaves a stale entry behind, which is dropped on the next walk.
+  ExpressionMap<SmallVector<Expression *, 4>> SubstitutionChildren;
 
   // Store all the PHIs that are considered to be Factors at any point in the
   // pass. Useful during kill time to separate ordinal and factored phis, since
   // former do save their operands, but later do not.
   SmallVector<Instruction *, 32> KillList;
+  // Mirrors KillList for constant time membership queries
+  SmallPtrSet<const Instruction *, 32> KillSet;
 
-public:
-  PreservedAnalyses run(Function &F, AnalysisManager<Function> &AM);
-
-private:
-  friend ssapre::SSAPRELegacy;
-  friend ssapre::phi_factoring::TokenPropagationSolver;
+  friend phi_factoring::TokenPropagationSolver;
 
   // Return a reference to the vector containing all Expressions that share
   // the same version with F, by definition those occur after the F
@@ -718,33 +1153,62 @@ private:
   bool OperandsDominateStrictly(const Expression *E, const Expression *F);
   bool OperandsDominateStrictly(const Instruction *I, const Expression *F);
 
+  // Check whether the memory state a Proto depends on is already defined at
+  // the start of a block or at an Expression. Expressions that do not read
+  // memory are always satisfied.
+  bool MemoryDefDominates(const Expression *PE, const BasicBlock *B);
+  bool MemoryDefDominates(const Instruction *I, const Expression *U);
+
+  // Check whether a load, a store or a Factor of a load Proto holds the value
+  // of the location under its clobbering access MA at a point it dominates
+  bool IsMemoryStateOf(const Expression *E, const MemoryAccess *MA);
+
+  // The memory state at the end of a block, and the clobbering access of a
+  // load Proto's location along an edge
+  MemoryAccess *GetMemoryStateAtEnd(const BasicBlock *B);
+  MemoryAccess *GetClobberOnEdge(const Expression *PE, const BasicBlock *B,
+                                 const BasicBlock *S);
+
+  // Check whether a user lies on the current DT path and happens before
+  // (including) the instruction. The path is implied by the dominator tree
+  // DFS interval of the user's block enclosing the instruction's block.
+  bool IsUsedBefore(const Instruction *U, const Instruction *I);
+
   // Find out whether Expression versions are used on a Path before(including)
   // another Expression occurrence
-  bool HasRealUseBefore(const Expression *S, const BBVector_t &P,
-                        const Expression *E);
+  bool HasRealUseBefore(const Expression *S, const Expression *E);
 
   // Find out whether Factor(its versions) is used on a Path before(including)
   // another Expression occurrence
-  bool FactorHasRealUseBefore(const FactorExpression *F, const BBVector_t &P,
-                              const Expression *E);
+  bool FactorHasRealUseBefore(const FactorExpression *F, const Expression *E);
 
   bool IgnoreExpression(const Expression *E);
   bool IsToBeKilled(Expression *E);
   bool IsToBeKilled(Instruction *I);
   bool AllUsersKilled(const Instruction *I);
+  // Add an instruction to the KillList unless it is already there
+  void AddToKillList(Instruction *I);
 
   void SetOrderBefore(Instruction *I, Instruction *B);
+  Expression *GetVExpr(const Instruction *I) const;
+  void SetVExpr(const Instruction *I, Expression *VE);
   void SetAllOperandsSave(Instruction *I);
   void AddSubstitution(Expression *E, Expression *S,
                        bool Direct = false, bool Force = false);
   void RemSubstitution(Expression *E);
 
+  // Union-find primitives over the substitution links
+  bool IsSubstitutionRoot(Expression *E);
+  Expression *FindSubstitutionRoot(Expression *E);
+  void SplitSubstitutionSet(Expression *E);
+
   // Go through all the Substitutions of the Expression and return the most
   // recent one
   Expression * GetSubstitution(Expression * E, bool Direct = false);
 
   // Go through all the substitutions of the Expression and return the most
   // recent value available
+  Value * GetAvailableValue(const Expression * E);
   Value * GetSubstituteValue(Expression * E);
 
   void AddConstant(ConstantExpression *CE, Constant *C);
@@ -779,6 +1243,7 @@ private:
   // have their order swapped when canonicalizing.
   bool ShouldSwapOperands(const Value *A, const Value *B) const;
 
+  void FillInStoreExpressionInfo(StoreInst &I, BasicExpression *E);
   bool FillInBasicExpressionInfo(Instruction &I, BasicExpression *E);
 
   std::pair<unsigned, unsigned>
@@ -795,15 +1260,48 @@ private:
   Expression * CreateUnknownExpression(Instruction &I);
   Expression * CreateBasicExpression(Instruction &I);
   Expression * CreatePHIExpression(PHINode &I);
+  Expression * CreateLoadExpression(LoadInst &I);
+  Expression * CreateStoreExpression(StoreInst &I);
+  Expression * CreateStoredLoadExpression(StoreInst &I);
+  bool IsMovableCall(const CallInst &I);
+  Expression * CreateCallExpression(CallInst &I);
+  Expression * CreateAggregateValueExpression(Instruction &I);
 
   FactorExpression *
   CreateFactorExpression(const Expression &E, const BasicBlock &B);
 
   Expression * CreateExpression(Instruction &I);
 
+  // Operand versioning, the expressions that use PHIs of their own block as
+  // operands are translated into the predecessors and merged with the
+  // occurrences available there
+  bool IsTranslatable(const Instruction *I);
+  Value * GetAvailableTranslation(const Instruction *E, ArrayRef<Value *> Ops,
+                                  const BasicBlock *P);
+  bool OperandVersioning();
+
+  // Memory versioning, the loads whose memory state is a MemoryPhi are
+  // translated into its block's predecessors under the incoming accesses
+  Value * GetAvailableLoadTranslation(const LoadInst *L, Value *Ptr,
+                                      const MemoryAccess *MA,
+                                      const BasicBlock *P);
+  bool MemoryVersioning();
+
+  // Store sinking, the stores of a loop that no load in it reads are partially
+  // dead, only the last one is needed and it goes to the exits
+  bool IsSinkableStoreLoop(
+      const Loop *L, const Value *Ptr, ArrayRef<StoreInst *> Stores,
+      SmallVectorImpl<std::pair<LoadInst *, StoreInst *>> &Loads);
+  bool StoreSinking();
+
   void Init(Function &F);
   void Fini();
 
+  // Runs a single step under its -time-passes timer and, if asked to, reports
+  // how much memory the expressions and the side tables take after it
+  void RunPhase(StringRef Name, StringRef Description,
+                function_ref<void()> Step);
+
   void FactorInsertionMaterialized();
   void FactorInsertionRegular();
   void FactorInsertion();
@@ -811,17 +1309,35 @@ private:
   void RenamePass();
   void RenameCleaup();
   void RenameInductivityPass();
+  void RenameFactorGraph();
   void Rename();
 
-  void ResetDownSafety(FactorExpression *F, Expression *E);
+  // These reset the flag of a Factor and propagate it over the Factor graph
+  void ResetDownSafety(FactorExpression *F);
   void DownSafety();
 
+  // Relaxes DownSafety for cheap expressions that cannot trap
+  bool CanSpeculate(FactorExpression *F);
+  void Speculate();
+
   void ComputeCanBeAvail();
   void ResetCanBeAvail(FactorExpression *F);
   void ComputeLater();
   void ResetLater(FactorExpression *F);
   void WillBeAvail();
 
+  // Keeps Factors from extending live ranges over the target's register budget,
+  // as long as the estimate stays within the work budget
+  bool ComputeLiveIns();
+  bool ExceedsRegisterBudget(FactorExpression *F);
+  void LimitRegisterPressure();
+
+  // Profile guided placement, it decides Factors' availability by a min-cut
+  // over the Factor graph weighted with block frequencies
+  uint64_t GetFrequency(const BasicBlock *B);
+  uint64_t GetRedundantFrequency(FactorExpression *F);
+  void MinCutPlacement();
+
   void Finalize();
 
   bool FactorCleanup(FactorExpression * F);
@@ -835,6 +1351,11 @@ private:
   bool KillEmAll();
   bool CodeMotion();
 
+  // Remarks for every change made to the IR
+  void ReportInserted(Instruction *I);
+  void ReportPHIInserted(PHINode *PHI, const Instruction *Proto);
+  void ReportDeleted(Instruction *I);
+
   enum PrintInfo : unsigned {
     PI_Inst = 1 << 0,
     PI_Expr = 1 << 1,
@@ -852,9 +1373,19 @@ private:
   void PrintDebugKillist();
   void PrintDebug(const std::string &Caption, PrintInfo PI = PI_Default);
 
+public:
   PreservedAnalyses
   runImpl(Function &F, AssumptionCache &_AC, TargetLibraryInfo &_TLI,
-          DominatorTree &_DT);
+          const TargetTransformInfo &_TTI, DominatorTree &_DT,
+          MemorySSA &_MSSA, OptimizationRemarkEmitter &_ORE,
+          BlockFrequencyInfo *_BFI);
+};
+} // end namespace ssapre
+
+/// Performs SSA PRE pass.
+class SSAPRE : public PassInfoMixin<SSAPRE> {
+public:
+  PreservedAnalyses run(Function &F, AnalysisManager<Function> &AM);
 };
 } // end namespace llvm
 
@@ -16,9 +16,18 @@
 #include "llvm/Transforms/Scalar/SSAPRE.h"
 #include "llvm/Transforms/Scalar.h"
 #include "llvm/Transforms/Utils/BreakCriticalEdges.h"
-#include "llvm/Analysis/IteratedDominanceFrontier.h"
+#include "llvm/Transforms/Utils/MemorySSA.h"
+#include "llvm/Transforms/Utils/MemorySSAUpdater.h"
+#include "llvm/Transforms/Utils/SSAUpdater.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/CaptureTracking.h"
 #include "llvm/Analysis/InstructionSimplify.h"
+#include "llvm/Analysis/Loads.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/OptimizationDiagnosticInfo.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
 #include "llvm/Analysis/ConstantFolding.h"
+#include "llvm/Analysis/ValueTracking.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/GlobalVariable.h"
 #include "llvm/IR/IRBuilder.h"
@@ -43,8 +52,11 @@
 #include "llvm/ADT/TinyPtrVector.h"
 #include "llvm/Support/Allocator.h"
 #include "llvm/Support/Casting.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
+#include "llvm/Support/Timer.h"
 #include "llvm/Support/raw_ostream.h"
+#include <limits>
 
 using namespace llvm;
 using namespace llvm::ssapre;
@@ -56,7 +68,80 @@ STATISTIC(SSAPREInstrInserted,     "Number of instructions inserted");
 STATISTIC(SSAPREInstrKilled,       "Number of instructions deleted");
 STATISTIC(SSAPREPHIInserted,       "Number of phi inserted");
 STATISTIC(SSAPREPHIKilled,         "Number of phi deleted");
-STATISTIC(SSAPREBlah,              "Blah");
+STATISTIC(SSAPREStoresSunk,        "Number of stores sunk out of loops");
+STATISTIC(SSAPREPeakMemory,        "Peak expression memory in bytes");
+STATISTIC(SSAPREOverBudget,        "Number of functions over the block budget");
+STATISTIC(SSAPRESkippedPExprs,     "Number of expressions left unfactored");
+STATISTIC(SSAPREPressureOverBudget,
+          "Number of functions over the budget for the pressure estimate");
+
+static const char *const TimerGroupName = "ssapre";
+static const char *const TimerGroupDescription =
+  "SSA Partial Redundancy Elimination";
+
+static cl::opt<bool> SSAPREProfileGuided(
+    "ssapre-profile-guided", cl::init(false), cl::Hidden,
+    cl::desc("Place computations where they minimize the dynamic execution "
+             "count, using block frequencies(MC-SSAPRE)"));
+
+static cl::opt<bool> SSAPRESpeculate(
+    "ssapre-speculate", cl::init(false), cl::Hidden,
+    cl::desc("Insert expressions that are safe to speculate even on paths "
+             "that do not use them"));
+
+static cl::opt<unsigned> SSAPRESpeculationThreshold(
+    "ssapre-speculation-threshold", cl::init(2), cl::Hidden,
+    cl::desc("The maximum number of instructions a single speculated Factor "
+             "may insert"));
+
+static cl::opt<bool> SSAPREOperandVersioning(
+    "ssapre-operand-versioning", cl::init(false), cl::Hidden,
+    cl::desc("Rewrite expressions over PHIs of their operands ahead of the "
+             "Factor insertion, a workaround for the missing Factors at "
+             "operand PHIs"));
+
+static cl::opt<bool> SSAPREMemoryVersioning(
+    "ssapre-memory-versioning", cl::init(false), cl::Hidden,
+    cl::desc("Replace the loads under MemoryPhis by PHIs ahead of the "
+             "Factor insertion, the store sinking needs them gone"));
+
+static cl::opt<bool> SSAPREStoreSinking(
+    "ssapre-store-sinking", cl::init(false), cl::Hidden,
+    cl::desc("Sink the stores of a loop that nothing in it reads to the loop "
+             "exits"));
+
+static cl::opt<bool> SSAPREPressureAware(
+    "ssapre-pressure-aware", cl::init(false), cl::Hidden,
+    cl::desc("Do not extend live ranges past the number of registers the "
+             "target has"));
+
+static cl::opt<unsigned> SSAPREMaxBlocks(
+    "ssapre-max-blocks", cl::init(100000), cl::Hidden,
+    cl::desc("Functions with more blocks only get their full redundancies "
+             "eliminated"));
+
+static cl::opt<unsigned> SSAPREMaxPExprs(
+    "ssapre-max-prototypes", cl::init(250000), cl::Hidden,
+    cl::desc("The maximum number of expressions to insert Factors for"));
+
+static cl::opt<unsigned> SSAPREMaxFactors(
+    "ssapre-max-factors", cl::init(1000000), cl::Hidden,
+    cl::desc("The maximum number of Factors to insert in a function"));
+
+static cl::opt<unsigned> SSAPREMaxWork(
+    "ssapre-max-work", cl::init(20000000), cl::Hidden,
+    cl::desc("The maximum number of instructions and Factor operands to "
+             "process in a function"));
+
+static cl::opt<unsigned> SSAPREMaxPressureWork(
+    "ssapre-max-pressure-work", cl::init(10000000), cl::Hidden,
+    cl::desc("The maximum number of uses and blocks to walk for the register "
+             "pressure estimate of a function"));
+
+static cl::opt<bool> SSAPREReportPhases(
+    "ssapre-report-phases", cl::init(false), cl::Hidden,
+    cl::desc("Print the expression memory and the side table sizes after "
+             "every step"));
 
 // Anchor methods.
 namespace llvm {
@@ -66,6 +151,10 @@ IgnoredExpression::~IgnoredExpression() = default;
 UnknownExpression::~UnknownExpression() = default;
 BasicExpression::~BasicExpression() = default;
 PHIExpression::~PHIExpression() = default;
+LoadExpression::~LoadExpression() = default;
+StoreExpression::~StoreExpression() = default;
+CallExpression::~CallExpression() = default;
+AggregateValueExpression::~AggregateValueExpression() = default;
 FactorExpression::~FactorExpression() = default;
 }
 }
@@ -74,35 +163,47 @@ FactorExpression::~FactorExpression() = default;
 // Utility
 //===----------------------------------------------------------------------===//
 
+// The statistic keeps the largest peak of all the functions. It is unsigned,
+// larger peaks are clamped.
+static void
+RaisePeakMemory(size_t Memory) {
+  unsigned Peak =
+      std::min<size_t>(Memory, std::numeric_limits<unsigned>::max());
+  if (Peak > SSAPREPeakMemory) SSAPREPeakMemory = Peak;
+}
+
 static bool
 IsVersionUnset(const Expression *E) {
   return E->getVersion() == VR_Unset;
 }
 
-static Expression TExpr(ET_Top,    ~2U, VR_Top);
-static Expression BExpr(ET_Bottom, ~2U, VR_Bottom);
-static Expression * GetTop()    { return &TExpr; }
-static Expression * GetBottom() { return &BExpr; }
+// The sentinels are shared by every context. They are handed out as mutable
+// only to fit the Expression * tables, Expression's setters assert they are
+// never written to.
+static const Expression TExpr(ET_Top,    ~2U, VR_Top,    EID_Top);
+static const Expression BExpr(ET_Bottom, ~2U, VR_Bottom, EID_Bottom);
+static Expression * GetTop()    { return const_cast<Expression *>(&TExpr); }
+static Expression * GetBottom() { return const_cast<Expression *>(&BExpr); }
 
-bool SSAPRE::
+bool SSAPREContext::
 IsTop(const Expression *E) {
   assert(E);
   return E == GetTop();
 }
 
-bool SSAPRE::
+bool SSAPREContext::
 IsBottom(const Expression *E) {
   assert(E);
   return E == GetBottom();
 }
 
-bool SSAPRE::
+bool SSAPREContext::
 IsBottomOrVarOrConst(const Expression *E) {
   assert(E);
   return E == GetBottom() || IsVariableOrConstant(E);
 }
 
-ExpVector_t & SSAPRE::
+ExpVector_t & SSAPREContext::
 GetSameVExpr(const FactorExpression *F) {
   assert(F && !IsBottomOrVarOrConst(F));
   auto PE = F->getPExpr();
@@ -110,7 +211,7 @@ GetSameVExpr(const FactorExpression *F) {
   return PExprToVersions[PE][F->getVersion()];
 }
 
-ExpVector_t & SSAPRE::
+ExpVector_t & SSAPREContext::
 GetSameVExpr(const Expression *E) {
   assert(E && !IsBottom(E));
   auto PE = ExprToPExpr[E];
@@ -118,14 +219,14 @@ GetSameVExpr(const Expression *E) {
   return PExprToVersions[PE][E->getVersion()];
 }
 
-bool SSAPRE::
+bool SSAPREContext::
 IsVariableOrConstant(const Expression *E) {
   assert(E);
   return E->getExpressionType() == ET_Variable ||
          E->getExpressionType() == ET_Constant;
 }
 
-bool SSAPRE::
+bool SSAPREContext::
 IsVariableOrConstant(const Value *V) {
   assert(V);
   return Argument::classof(V) ||
@@ -133,7 +234,7 @@ IsVariableOrConstant(const Value *V) {
          Constant::classof(V);
 }
 
-bool SSAPRE::
+bool SSAPREContext::
 IsFactoredPHI(Instruction *I) {
   assert(I);
   if (auto PHI = dyn_cast<PHINode>(I)) {
@@ -142,7 +243,7 @@ IsFactoredPHI(Instruction *I) {
   return false;
 }
 
-const Instruction * SSAPRE::
+const Instruction * SSAPREContext::
 GetDomRepresentativeInstruction(const Expression * E) {
   // There is a certain dominance trickery with factored and non-factored PHIs.
   // The factored PHIs always dominate non-factored ones, in this regard plain
@@ -160,7 +261,7 @@ GetDomRepresentativeInstruction(const Expression * E) {
   return VExprToInst[E];
 }
 
-bool SSAPRE::
+bool SSAPREContext::
 StrictlyDominates(const Expression *Def, const Expression *Use) {
   assert (Def && Use && "Def or Use is null");
 
@@ -175,7 +276,7 @@ StrictlyDominates(const Expression *Def, const Expression *Use) {
   return DT->dominates(IDef, IUse);
 }
 
-bool SSAPRE::
+bool SSAPREContext::
 NotStrictlyDominates(const Expression *Def, const Expression *Use) {
   assert (Def && Use && "Def or Use is null");
 
@@ -190,13 +291,15 @@ NotStrictlyDominates(const Expression *Def, const Expression *Use) {
   return DT->dominates(IDef, IUse);
 }
 
-bool SSAPRE::
+bool SSAPREContext::
 OperandsDominate(const Expression *Def, const Expression *Use) {
   return OperandsDominate(VExprToInst[Def], Use);
 }
 
-bool SSAPRE::
+bool SSAPREContext::
 OperandsDominate(const Instruction *I, const Expression *Use) {
+  if (!MemoryDefDominates(I, Use)) return false;
+
   for (auto &O : I->operands()) {
     auto E = ValueToExp[O];
 
@@ -206,10 +309,17 @@ OperandsDominate(const Instruction *I, const Expression *Use) {
     // We want to use the earliest occurrence of the operand, it will be either
     // a Factor, another definition or the same definition if it defines a new
     // version.
+    auto OE = E;
     E = GetSubstitution(E);
 
     if (IsVariableOrConstant(E)) continue;
 
+    // The operand was replaced by a Factor that is never available
+    if (IsBottom(E)) return false;
+
+    // The operand's Factor was dropped, the operand itself stays in place
+    if (IsTop(E)) E = OE;
+
     // Due to the way we check dominance for factors we need to use non-strict
     // dominance if both operands a factors
     if (!NotStrictlyDominates(E, Use)) return false;
@@ -218,13 +328,15 @@ OperandsDominate(const Instruction *I, const Expression *Use) {
   return true;
 }
 
-bool SSAPRE::
+bool SSAPREContext::
 OperandsDominateStrictly(const Expression *Def, const Expression *Use) {
   return OperandsDominateStrictly(VExprToInst[Def], Use);
 }
 
-bool SSAPRE::
+bool SSAPREContext::
 OperandsDominateStrictly(const Instruction *I, const Expression *Use) {
+  if (!MemoryDefDominates(I, Use)) return false;
+
   for (auto &O : I->operands()) {
     auto E = ValueToExp[O];
 
@@ -234,20 +346,159 @@ OperandsDominateStrictly(const Instruction *I, const Expression *Use) {
     // We want to use the earliest occurrence of the operand, it will be either
     // a Factor, another definition or the same definition if it defines a new
     // version.
+    auto OE = E;
     E = GetSubstitution(E);
 
     if (IsVariableOrConstant(E)) continue;
 
+    // The operand was replaced by a Factor that is never available
+    if (IsBottom(E)) return false;
+
+    // The operand's Factor was dropped, the operand itself stays in place
+    if (IsTop(E)) E = OE;
+
     if (!StrictlyDominates(E, Use)) return false;
   }
 
   return true;
 }
 
-bool SSAPRE::
-HasRealUseBefore(const Expression *S, const BBVector_t &P,
-                 const Expression *E) {
-  auto EDFS = InstrDFS[VExprToInst[E]];
+// Returns true if the Proto depends on a memory state, MA is set to it. The
+// loads are versioned by their memory state instead, see IsMemoryStateOf.
+static bool GetMemoryState(const Expression *PE, const MemoryAccess *&MA) {
+  if (auto CE = dyn_cast_or_null<CallExpression>(PE)) {
+    MA = CE->getMemDef();
+    return CE->getReadsMemory();
+  }
+  return false;
+}
+
+bool SSAPREContext::
+MemoryDefDominates(const Expression *PE, const BasicBlock *B) {
+  const MemoryAccess *MA = nullptr;
+  if (!GetMemoryState(PE, MA)) return true;
+  if (!MA) return false;
+  if (MSSA->isLiveOnEntryDef(MA)) return true;
+
+  // A Factor at the block of the access itself would join values that were
+  // observed under different memory states
+  return DT->properlyDominates(MA->getBlock(), B);
+}
+
+bool SSAPREContext::
+MemoryDefDominates(const Instruction *I, const Expression *Use) {
+  auto VE = GetVExpr(I);
+
+  // A load assumes the version of a Factor only if it observes the memory
+  // state the Factor joins, a store defines a new one. Anywhere else a load
+  // reads the memory as it is, so its copies may go wherever the address is
+  // available.
+  if (VE && (LoadExpression::classof(VE) || StoreExpression::classof(VE))) {
+    if (!FactorExpression::classof(Use)) return true;
+    if (StoreExpression::classof(VE)) return false;
+    return IsMemoryStateOf(Use, cast<LoadExpression>(VE)->getMemDef());
+  }
+
+  if (!I->mayReadFromMemory()) return true;
+
+  // The memory state is a property of the Proto, inserted copies do not have
+  // one of their own
+  auto PE = VE ? ExprToPExpr.lookup(VE) : nullptr;
+  const MemoryAccess *MA = nullptr;
+  if (!GetMemoryState(PE, MA)) return true;
+
+  if (auto F = dyn_cast<FactorExpression>(Use))
+    return MemoryDefDominates(PE, FactorToBlock[F]);
+
+  if (!MA) return false;
+  if (MSSA->isLiveOnEntryDef(MA)) return true;
+
+  auto UI = GetDomRepresentativeInstruction(Use);
+  if (auto MUD = dyn_cast<MemoryUseOrDef>(MA))
+    return DT->dominates(MUD->getMemoryInst(), UI);
+  return DT->dominates(MA->getBlock(), UI->getParent());
+}
+
+bool SSAPREContext::
+IsMemoryStateOf(const Expression *E, const MemoryAccess *MA) {
+  if (!MA) return false;
+
+  // A Factor joins the values the location has at the start of its block, MA
+  // must be the block's MemoryPhi or be above the block, otherwise something
+  // clobbers the location in between
+  if (auto F = dyn_cast<FactorExpression>(E)) {
+    auto B = FactorToBlock[F];
+    return MA == MSSA->getMemoryAccess(B) || MSSA->isLiveOnEntryDef(MA) ||
+           DT->properlyDominates(MA->getBlock(), B);
+  }
+
+  // Two accesses of the location with the same clobber see the same value
+  if (auto LE = dyn_cast<LoadExpression>(E)) return LE->getMemDef() == MA;
+  if (auto SE = dyn_cast<StoreExpression>(E)) return SE->getMemDef() == MA;
+  return false;
+}
+
+MemoryAccess *SSAPREContext::
+GetMemoryStateAtEnd(const BasicBlock *B) {
+  // A block without a MemoryPhi or a MemoryDef of its own passes on the state
+  // of its immediate dominator, every path into it crosses the same last
+  // definition
+  SmallVector<const BasicBlock *, 8> Path;
+  MemoryAccess *MA = nullptr;
+  for (auto N = DT->getNode(const_cast<BasicBlock *>(B)); N && !MA;
+       N = N->getIDom()) {
+    auto It = MemoryStateAtEnd.find(N->getBlock());
+    if (It != MemoryStateAtEnd.end()) {
+      MA = It->second;
+      break;
+    }
+
+    Path.push_back(N->getBlock());
+    if (auto Defs = MSSA->getBlockDefs(N->getBlock()))
+      MA = const_cast<MemoryAccess *>(&Defs->back());
+  }
+
+  if (!MA) MA = MSSA->getLiveOnEntryDef();
+  for (auto PB : Path) MemoryStateAtEnd[PB] = MA;
+  return MA;
+}
+
+MemoryAccess *SSAPREContext::
+GetClobberOnEdge(const Expression *PE, const BasicBlock *B,
+                 const BasicBlock *S) {
+  auto MP = MSSA->getMemoryAccess(S);
+  MemoryAccess *MA = MP ? cast<MemoryAccess>(MP->getIncomingValueForBlock(B))
+                        : GetMemoryStateAtEnd(B);
+  auto L = cast<LoadInst>(PE->getProto());
+  return MSSAWalker->getClobberingMemoryAccess(MA, MemoryLocation::get(L));
+}
+
+bool SSAPREContext::
+IsUsedBefore(const Instruction *U, const Instruction *I) {
+  // The DT does not take const blocks though it does not alter them either
+  auto GetNode = [&](const BasicBlock *B) {
+    return DT->getNode(const_cast<BasicBlock *>(B));
+  };
+
+  // Users outside of the function or in unreachable blocks are not on any path
+  auto UB = U->getParent();
+  if (!UB) return false;
+  auto UN = GetNode(UB);
+  if (!UN) return false;
+
+  // The Path is the chain of dominators of the I's block, so the user is on
+  // it iff its block's DFS interval encloses I's block's one. Every
+  // instruction of a strictly dominating block precedes I in DFS order, thus
+  // the order comparison matters for the same block only.
+  auto IN = GetNode(I->getParent());
+  if (IN->getDFSNumIn() < UN->getDFSNumIn() ||
+      IN->getDFSNumOut() > UN->getDFSNumOut()) return false;
+  return InstrDFS.lookup(U) <= InstrDFS.lookup(I);
+}
+
+bool SSAPREContext::
+HasRealUseBefore(const Expression *S, const Expression *E) {
+  auto EI = VExprToInst[E];
 
   // We need to check every expression that shares the same version
   for (auto V : GetSameVExpr(S)) {
@@ -258,21 +509,16 @@ HasRealUseBefore(const Expression *S, const BBVector_t &P,
       // through the main algorithm
       if (IsFactoredPHI(UI)) continue;
 
-      auto UB = UI->getParent();
-      for (auto PB : P) {
-        // User is on the Path and it happens before E
-        if (UB == PB && InstrDFS[UI] <= EDFS) return true;
-      }
+      if (IsUsedBefore(UI, EI)) return true;
     }
   }
 
   return false;
 }
 
-bool SSAPRE::
-FactorHasRealUseBefore(const FactorExpression *F, const BBVector_t &P,
-                       const Expression *E) {
-  auto EDFS = InstrDFS[VExprToInst[E]];
+bool SSAPREContext::
+FactorHasRealUseBefore(const FactorExpression *F, const Expression *E) {
+  auto EI = VExprToInst[E];
 
   // If Factor is linked with a PHI we need to check its users.
   if (auto PHI = FactorToPHI[F]) {
@@ -283,11 +529,7 @@ FactorHasRealUseBefore(const FactorExpression *F, const BBVector_t &P,
       // through the main algorithm
       if (IsFactoredPHI(UI)) continue;
 
-      auto UB = UI->getParent();
-      for (auto PB : P) {
-        // User is on the Path and it happens before E
-        if (UB == PB && InstrDFS[UI] <= EDFS) return true;
-      }
+      if (IsUsedBefore(UI, EI)) return true;
     }
   }
 
@@ -301,18 +543,14 @@ FactorHasRealUseBefore(const FactorExpression *F, const BBVector_t &P,
       // through the main algorithm
       if (IsFactoredPHI(UI)) continue;
 
-      auto UB = UI->getParent();
-      for (auto PB : P) {
-        // User is on the Path and it happens before E
-        if (UB == PB && InstrDFS[UI] <= EDFS) return true;
-      }
+      if (IsUsedBefore(UI, EI)) return true;
     }
   }
 
   return false;
 }
 
-bool SSAPRE::
+bool SSAPREContext::
 IgnoreExpression(const Expression *E) {
   assert(E);
   auto ET = E->getExpressionType();
@@ -322,54 +560,62 @@ IgnoreExpression(const Expression *E) {
          ET == ET_Constant;
 }
 
-bool SSAPRE::
+bool SSAPREContext::
 IsToBeKilled(Expression *E) {
   assert(E);
   auto V = ExpToValue[E];
   assert(V);
-  for (auto K : KillList) {
-    if (V == K) return true;
-  }
-  return false;
+  auto I = dyn_cast<Instruction>(V);
+  return I && KillSet.count(I);
 }
 
-bool SSAPRE::
+bool SSAPREContext::
 IsToBeKilled(Instruction *I) {
   assert(I);
-  for (auto K : KillList) {
-    if (I == K) return true;
-  }
-  return false;
+  return KillSet.count(I);
 }
 
-bool SSAPRE::
+bool SSAPREContext::
 AllUsersKilled(const Instruction *I) {
   assert(I);
   for (auto U : I->users()) {
     auto UI = (Instruction *)U;
-    if (UI->getParent()) {
-      bool Killed = false;
-      for (auto K : KillList) {
-        if (K == UI) {
-          Killed = true;
-          break;
-        }
-      }
-
-      if (!Killed) return false;
-    }
+    if (UI->getParent() && !KillSet.count(UI)) return false;
   }
   return true;
 }
 
-void SSAPRE::
+void SSAPREContext::
+AddToKillList(Instruction *I) {
+  assert(I);
+  // Stores only serve as available definitions of loads, they are never
+  // occurrences of their own and so never removed
+  if (isa<StoreInst>(I)) return;
+  if (KillSet.insert(I).second)
+    KillList.push_back(I);
+}
+
+void SSAPREContext::
 SetOrderBefore(Instruction *I, Instruction *B) {
   assert(I && B);
   InstrSDFS[I] = InstrSDFS[B]; InstrSDFS[B]++;
   InstrDFS[I]  = InstrDFS[B];  InstrDFS[B]++;
 }
 
-void SSAPRE::
+Expression *SSAPREContext::
+GetVExpr(const Instruction *I) const {
+  auto It = InstrID.find(I);
+  return It != InstrID.end() ? InstToVExpr[It->second] : nullptr;
+}
+
+void SSAPREContext::
+SetVExpr(const Instruction *I, Expression *VE) {
+  auto ID = InstrID.insert({I, InstToVExpr.size()}).first->second;
+  if (ID >= InstToVExpr.size()) InstToVExpr.resize(ID + 1);
+  InstToVExpr[ID] = VE;
+}
+
+void SSAPREContext::
 SetAllOperandsSave(Instruction *I) {
   assert(I);
   for (auto &U : I->operands()) {
@@ -378,7 +624,61 @@ SetAllOperandsSave(Instruction *I) {
   }
 }
 
-void SSAPRE::
+bool SSAPREContext::
+IsSubstitutionRoot(Expression *E) {
+  if (IsBottomOrVarOrConst(E) || IsTop(E)) return true;
+
+  // An expression without a record substitutes itself
+  auto P = SubstitutionParents.lookup(E);
+  return !P || P == E;
+}
+
+Expression * SSAPREContext::
+FindSubstitutionRoot(Expression *E) {
+  auto R = E;
+  while (!IsSubstitutionRoot(R)) R = SubstitutionParents[R];
+
+  // Compress the path
+  while (E != R) {
+    auto &P = SubstitutionParents[E];
+    auto N = P;
+    P = R;
+    E = N;
+  }
+
+  return R;
+}
+
+void SSAPREContext::
+SplitSubstitutionSet(Expression *E) {
+  // Union-find only ever merges sets, so whenever a link that is not a root
+  // changes, a parent compressed past it is stale. Only the expressions whose
+  // chain of direct links passes through E can have one, they go back to their
+  // direct links and the rest of the forest stays intact.
+  SmallPtrSet<Expression *, 8> Visited;
+  SmallVector<Expression *, 8> Worklist;
+  Worklist.push_back(E);
+  while (!Worklist.empty()) {
+    auto P = Worklist.pop_back_val();
+    if (!SubstitutionChildren.count(P)) continue;
+
+    // The children relinked elsewhere since are dropped on the way
+    auto &Children = SubstitutionChildren[P];
+    Children.erase(remove_if(Children,
+                             [&](Expression *C) {
+                               return Substitutions.lookup(C) != P;
+                             }),
+                   Children.end());
+
+    for (auto C : Children) {
+      if (!Visited.insert(C).second) continue;
+      SubstitutionParents[C] = P;
+      Worklist.push_back(C);
+    }
+  }
+}
+
+void SSAPREContext::
 AddSubstitution(Expression *E, Expression *S, bool Direct, bool Force) {
   assert(E && S);
   assert((Force ||
@@ -387,81 +687,70 @@ AddSubstitution(Expression *E, Expression *S, bool Direct, bool Force) {
       IsTop(S)) &&
       "Substituting expression must be of the same Proto or Top or Bottom");
 
-
-  auto *PE = ExprToPExpr[E];
-  if (!PE) PE = E;
-
-  assert(PE);
-
-  if (!Substitutions.count(PE)) {
-    Substitutions.insert({PE, ExpExpMap()});
-  }
-
-  auto &MA = Substitutions[PE];
-
-  if (E == S) {
-    MA[E] = S;
-    return;
-  }
-
-  if (!Direct) {
+  if (E != S && !Direct) {
     // Try get the last one
     if (auto SS = GetSubstitution(S)) S = SS;
   }
 
-  if (
-      // Any F -> E substitution serves as a jump record
-      !FactorExpression::classof(E) &&
-      // Only if this is the first time we add this substitution
-      MA[E] != S) {
+  auto L = Substitutions.lookup(E);
+
+  // Only if this is the first time we add this substitution
+  if (L == S) return;
+
+  // Any F -> E substitution serves as a jump record, and the sentinels do
+  // not count their uses
+  if (E != S && !FactorExpression::classof(E) && !S->isSentinel())
     S->addSave();
-  }
 
-  assert(S);
-  MA[E] = S;
+  // A root joins S's set along with everything compressed onto it, any other
+  // link change splits the set first
+  if (L && L != E) SplitSubstitutionSet(E);
+  if (E != S) SubstitutionChildren[S].push_back(E);
+
+  Substitutions[E] = S;
+  SubstitutionParents[E] = S;
 }
 
-Expression * SSAPRE::
+Expression * SSAPREContext::
 GetSubstitution(Expression *E, bool Direct) {
   assert(E);
 
   if (IsBottomOrVarOrConst(E) || IsTop(E)) return E;
 
-  auto PE = ExprToPExpr[E];
-  if (!PE) PE = E;
-  if (!Substitutions.count(PE)) {
-    llvm_unreachable("This type of expressions does not exist in the record");
-  }
-  auto &MA = Substitutions[PE];
-
   if (Direct) {
-    auto S = MA[E];
-    if (S) return S;
-    return E;
-  }
-
-  while (auto EE = GetSubstitution(E, true)) {
-    assert(EE && "Substitution cannot be null");
-    if (IsBottom(EE) || IsTop(EE)) return EE;
-    if (E == EE) return E;
-    E = EE;
+    auto S = Substitutions.lookup(E);
+    return S ? S : E;
   }
 
-  return E;
+  return FindSubstitutionRoot(E);
 }
 
-void SSAPRE::
+void SSAPREContext::
 RemSubstitution(Expression *E) {
   assert(E);
 
-  auto PE = ExprToPExpr[E];
-  assert(PE);
+  if (!Substitutions.lookup(E)) return;
+
+  // Nothing may stay compressed onto or through the removed expression. Its
+  // children keep their direct links to it, so the list stays as well.
+  SplitSubstitutionSet(E);
+
+  Substitutions.erase(E);
+  SubstitutionParents.erase(E);
+}
 
-  if (Substitutions.count(PE))
-    Substitutions[PE].erase(E);
+Value * SSAPREContext::
+GetAvailableValue(const Expression *E) {
+  auto V = ExpToValue.lookup(E);
+
+  // A store defines the value it writes, we read the operand only now since
+  // it might have been substituted itself
+  if (auto SI = dyn_cast_or_null<StoreInst>(V))
+    return SI->getValueOperand();
+  return V;
 }
 
-Value * SSAPRE::
+Value * SSAPREContext::
 GetSubstituteValue(Expression *E) {
   E = GetSubstitution(E);
   if (auto F = dyn_cast<FactorExpression>(E)) {
@@ -470,10 +759,10 @@ GetSubstituteValue(Expression *E) {
     else
       llvm_unreachable("Must not have happened");
   }
-  return (Value *)ExpToValue[E];
+  return GetAvailableValue(E);
 }
 
-void SSAPRE::
+void SSAPREContext::
 AddConstant(ConstantExpression *CE, Constant *C) {
   assert(CE && C);
   ExpToValue[CE] = C;
@@ -482,14 +771,14 @@ AddConstant(ConstantExpression *CE, Constant *C) {
   ValueToCOExp[C] = CE;
 }
 
-void SSAPRE::
+void SSAPREContext::
 AddExpression(Expression *PE, Expression *VE, Instruction *I, BasicBlock *B) {
   assert(PE && VE && I && B);
 
   ExpToValue[VE] = I;
   ValueToExp[I] = VE;
 
-  InstToVExpr[I] = VE;
+  SetVExpr(I, VE);
   VExprToInst[VE] = I;
   ExprToPExpr[VE] = PE;
 
@@ -515,7 +804,7 @@ AddExpression(Expression *PE, Expression *VE, Instruction *I, BasicBlock *B) {
   AddSubstitution(VE, VE);
 }
 
-void SSAPRE::
+void SSAPREContext::
 AddFactor(FactorExpression *FE, const Expression *PE, const BasicBlock *B) {
   assert(FE && PE && B);
   assert(FE != PE);
@@ -529,7 +818,7 @@ AddFactor(FactorExpression *FE, const Expression *PE, const BasicBlock *B) {
   AddSubstitution(FE, FE);
 }
 
-void SSAPRE::
+void SSAPREContext::
 KillFactor(FactorExpression *F, bool BottomSubstitute) {
   assert(F);
 
@@ -561,26 +850,26 @@ KillFactor(FactorExpression *F, bool BottomSubstitute) {
   }
 }
 
-void SSAPRE::
+void SSAPREContext::
 MaterializeFactor(FactorExpression *FE, PHINode *PHI) {
   assert(FE && PHI);
 
   FE->setIsMaterialized(true);
 
   // These may not exist if we just materialized the phi
-  auto PVE = InstToVExpr[PHI];
-  auto PPE = ExprToPExpr[PVE];
+  auto PVE = GetVExpr(PHI);
+  auto PPE = ExprToPExpr.lookup(PVE);
 
   if (PPE) {
     // We need to remove anything related to this PHIs original prototype,
     // because before we verified that this PHI is actually a Factor it was based
     // on its own PHI proto instance.
+    PExprTable.erase(PPE);
     PExprToVExprs.erase(PPE);
     PExprToInsts.erase(PPE);
     PExprToBlocks.erase(PPE);
     PExprToVersions.erase(PPE);
 
-    PPE->getProto()->dropAllReferences();
     ExpressionAllocator.Deallocate(PPE);
   }
 
@@ -594,8 +883,10 @@ MaterializeFactor(FactorExpression *FE, PHINode *PHI) {
 
     // If there is a Factor that uses this PHI as operand
     for (auto F : FExprs) {
-      if (F->hasVExpr(PVE))
+      if (F->hasVExpr(PVE)) {
         F->replaceVExpr(PVE, FE);
+        FactorUsers[FE].push_back(F);
+      }
     }
 
     ExpressionAllocator.Deallocate(PVE);
@@ -605,7 +896,7 @@ MaterializeFactor(FactorExpression *FE, PHINode *PHI) {
   FactorToPHI[FE] = PHI;
   PHIToFactor[PHI] = FE;
 
-  InstToVExpr[PHI] = FE;
+  SetVExpr(PHI, FE);
   VExprToInst[FE] = PHI;
   // ExprToPExpr[FE] = FE;
 
@@ -613,7 +904,7 @@ MaterializeFactor(FactorExpression *FE, PHINode *PHI) {
   ValueToExp[PHI] = FE;
 }
 
-bool SSAPRE::
+bool SSAPREContext::
 ReplaceFactor(FactorExpression *FE, Expression *VE, bool HRU, bool Direct) {
   if (FE->getIsMaterialized()) {
     ReplaceFactorMaterialized(FE, VE, HRU, Direct);
@@ -624,7 +915,7 @@ ReplaceFactor(FactorExpression *FE, Expression *VE, bool HRU, bool Direct) {
   return false;
 }
 
-void SSAPRE::
+void SSAPREContext::
 ReplaceFactorMaterialized(FactorExpression * FE, Expression * VE,
                           bool HRU, bool Direct) {
   assert(FE && VE);
@@ -640,7 +931,7 @@ ReplaceFactorMaterialized(FactorExpression * FE, Expression * VE,
   for (auto U : PHI->users()) {
 
     auto UI = (Instruction *)U;
-    auto UE  = InstToVExpr[UI];
+    auto UE  = GetVExpr(UI);
 
     // Skip instruction without parents
     if (!UI->getParent()) continue;
@@ -650,13 +941,14 @@ ReplaceFactorMaterialized(FactorExpression * FE, Expression * VE,
                         for a regular non-factored instruction");
     }
 
-    VE->addSave();
+    // The sentinels do not count their uses
+    if (!IsTopOrBot) VE->addSave();
   }
 
   // Replace all PHI uses with a real instruction result only
   if (!IsTopOrBot &&
       !(FactorExpression::classof(VE) && !FactorToPHI[(FactorExpression*)VE])) {
-    auto V = (Value *)ExpToValue[VE];
+    auto V = GetAvailableValue(VE);
     PHI->replaceAllUsesWith(V);
     SSAPREInstrSubstituted++;
   }
@@ -665,13 +957,13 @@ ReplaceFactorMaterialized(FactorExpression * FE, Expression * VE,
   PHIToFactor[PHI] = nullptr;
   FactorToPHI[FE] = nullptr;
 
-  KillList.push_back(PHI);
+  AddToKillList(PHI);
 
   // The rest is the same as for non-materialized Factor
   ReplaceFactorFinalize(FE, VE, HRU, Direct);
 }
 
-void SSAPRE::
+void SSAPREContext::
 ReplaceFactorFinalize(FactorExpression *FE, Expression *VE,
                       bool HRU, bool Direct) {
   assert(FE && VE);
@@ -683,14 +975,18 @@ ReplaceFactorFinalize(FactorExpression *FE, Expression *VE,
   // Replace all Factor uses. Note that we do not add Save for each Factor use,
   // because Factors do not use their operands before they're materialized, or
   // in case of already materialized not-removed during CodeMotion step.
-  auto List = FExprs; // Can be modified insdie the cycle
-  for (auto F : List) {
-    if (F == FE) continue;
+  auto VF = dyn_cast<FactorExpression>(VE);
+  auto Users = FactorUsers[FE]; // Can be modified inside the cycle
+  for (auto F : Users) {
+    // The user list may contain killed Factors or Factors that no longer use
+    // this one
+    if (F == FE || !FExprs.count(F)) continue;
     for (auto BB : F->getPreds()) {
       if (F->getVExpr(BB) != FE) continue;
 
       F->setVExpr(BB, VE);
-      F->setHasRealUse(VE, HRU);
+      F->setHasRealUse(BB, HRU);
+      if (VF) FactorUsers[VF].push_back(F);
 
       // If we assign the same version we create a cycle
       if (F->getVersion() == VE->getVersion()) {
@@ -725,7 +1021,7 @@ ReplaceFactorFinalize(FactorExpression *FE, Expression *VE,
   AddSubstitution(FE, VE, Direct);
 }
 
-unsigned int SSAPRE::
+unsigned int SSAPREContext::
 GetRank(const Value *V) const {
   // Prefer undef to anything else
   if (isa<UndefValue>(V))
@@ -746,7 +1042,7 @@ GetRank(const Value *V) const {
   return ~0;
 }
 
-bool SSAPRE::
+bool SSAPREContext::
 ShouldSwapOperands(const Value *A, const Value *B) const {
   // Because we only care about a total ordering, and don't rewrite expressions
   // in this order, we order by rank, which will give a strict weak ordering to
@@ -754,7 +1050,26 @@ ShouldSwapOperands(const Value *A, const Value *B) const {
   return std::make_pair(GetRank(A), A) > std::make_pair(GetRank(B), B);
 }
 
-bool SSAPRE::
+void SSAPREContext::
+FillInStoreExpressionInfo(StoreInst &I, BasicExpression *E) {
+  assert(E);
+
+  // The expression looks exactly like the load of the stored value
+  E->setType(I.getValueOperand()->getType());
+  E->setOpcode(Instruction::Load);
+  E->addOperand(I.getPointerOperand());
+
+  for (auto &O : I.operands()) {
+    if (auto *C = dyn_cast<Constant>(O)) {
+      if (!ValueToCOExp[C]) {
+        auto CE = CreateConstantExpression(*C);
+        AddConstant(CE, C);
+      }
+    }
+  }
+}
+
+bool SSAPREContext::
 FillInBasicExpressionInfo(Instruction &I, BasicExpression *E) {
   assert(E);
 
@@ -787,7 +1102,7 @@ FillInBasicExpressionInfo(Instruction &I, BasicExpression *E) {
   return AllConstant;
 }
 
-std::pair<unsigned, unsigned> SSAPRE::
+std::pair<unsigned, unsigned> SSAPREContext::
 AssignDFSNumbers(BasicBlock *B, unsigned Start, InstrToOrderType *M) {
   unsigned End = Start;
   // if (MemoryAccess *MemPhi = MSSA->getMemoryAccess(B)) {
@@ -804,7 +1119,7 @@ AssignDFSNumbers(BasicBlock *B, unsigned Start, InstrToOrderType *M) {
   return std::make_pair(Start, End);
 }
 
-Expression *SSAPRE::
+Expression *SSAPREContext::
 CheckSimplificationResults(Expression *E, Instruction &I, Value *V) {
   if (!V) return nullptr;
 
@@ -823,41 +1138,46 @@ CheckSimplificationResults(Expression *E, Instruction &I, Value *V) {
   return nullptr;
 }
 
-ConstantExpression *SSAPRE::
+ConstantExpression *SSAPREContext::
 CreateConstantExpression(Constant &C) {
   auto *E = new (ExpressionAllocator) ConstantExpression(C);
+  E->setID(LastExpressionID++);
   E->setOpcode(C.getValueID());
   E->setVersion(LastConstantVersion--);
   return E;
 }
 
-VariableExpression *SSAPRE::
+VariableExpression *SSAPREContext::
 CreateVariableExpression(Value &V) {
   auto *E = new (ExpressionAllocator) VariableExpression(V);
+  E->setID(LastExpressionID++);
   E->setOpcode(V.getValueID());
   E->setVersion(LastVariableVersion--);
   return E;
 }
 
-Expression * SSAPRE::
+Expression * SSAPREContext::
 CreateIgnoredExpression(Instruction &I) {
   auto *E = new (ExpressionAllocator) IgnoredExpression(&I);
+  E->setID(LastExpressionID++);
   E->setOpcode(I.getOpcode());
   E->setVersion(LastIgnoredVersion--);
   return E;
 }
 
-Expression * SSAPRE::
+Expression * SSAPREContext::
 CreateUnknownExpression(Instruction &I) {
   auto *E = new (ExpressionAllocator) UnknownExpression(&I);
+  E->setID(LastExpressionID++);
   E->setOpcode(I.getOpcode());
   E->setVersion(LastIgnoredVersion--);
   return E;
 }
 
-Expression * SSAPRE::
+Expression * SSAPREContext::
 CreateBasicExpression(Instruction &I) {
   auto *E = new (ExpressionAllocator) BasicExpression();
+  E->setID(LastExpressionID++);
 
   bool AllConstant = FillInBasicExpressionInfo(I, E);
 
@@ -943,22 +1263,120 @@ CreateBasicExpression(Instruction &I) {
   return E;
 }
 
-Expression *SSAPRE::
+Expression *SSAPREContext::
 CreatePHIExpression(PHINode &I) {
   auto *E = new (ExpressionAllocator) PHIExpression(I.getParent());
+  E->setID(LastExpressionID++);
+  FillInBasicExpressionInfo(I, E);
+  return E;
+}
+
+Expression *SSAPREContext::
+CreateLoadExpression(LoadInst &I) {
+  // Volatile and atomic loads stay where they are
+  if (!I.isSimple()) return nullptr;
+
+  // Copies we insert are unknown to MemorySSA, but they are never used to
+  // lookup a Proto anyway
+  const MemoryAccess *MA = nullptr;
+  if (MSSA->getMemoryAccess(&I))
+    MA = MSSAWalker->getClobberingMemoryAccess(&I);
+
+  auto *E = new (ExpressionAllocator) LoadExpression(MA);
+  E->setID(LastExpressionID++);
+  FillInBasicExpressionInfo(I, E);
+  return E;
+}
+
+Expression *SSAPREContext::
+CreateStoreExpression(StoreInst &I) {
+  // Volatile and atomic stores are left alone and do not define anything
+  if (!I.isSimple()) return nullptr;
+
+  auto MA = MSSA->getMemoryAccess(&I);
+  if (!MA) return nullptr;
+
+  auto *E = new (ExpressionAllocator) StoreExpression(MA);
+  E->setID(LastExpressionID++);
+  FillInStoreExpressionInfo(I, E);
+  return E;
+}
+
+Expression *SSAPREContext::
+CreateStoredLoadExpression(StoreInst &I) {
+  auto *E = new (ExpressionAllocator)
+    LoadExpression(MSSA->getMemoryAccess(&I));
+  E->setID(LastExpressionID++);
+  FillInStoreExpressionInfo(I, E);
+  return E;
+}
+
+bool SSAPREContext::
+IsMovableCall(const CallInst &I) {
+  // We need a value to reuse and nothing else to happen, only the memory read
+  // by a readonly call is tracked
+  if (I.getType()->isVoidTy() || !I.onlyReadsMemory() || !I.doesNotThrow())
+    return false;
+  if (I.isInlineAsm() || I.isConvergent() || I.hasOperandBundles() ||
+      I.isNoBuiltin() || I.isMustTailCall())
+    return false;
+
+  // A library function the target does not provide may be the program's own
+  // definition under the same name, so only trust the available ones
+  if (auto F = I.getCalledFunction()) {
+    LibFunc LF;
+    if (TLI->getLibFunc(*F, LF) && !TLI->has(LF)) return false;
+  }
+
+  return true;
+}
+
+Expression *SSAPREContext::
+CreateCallExpression(CallInst &I) {
+  if (!IsMovableCall(I)) return nullptr;
+
+  // The readonly calls are versioned against MemorySSA exactly as loads
+  bool ReadsMemory = !I.doesNotAccessMemory();
+  const MemoryAccess *MA = nullptr;
+  if (ReadsMemory && MSSA->getMemoryAccess(&I))
+    MA = MSSAWalker->getClobberingMemoryAccess(&I);
+
+  auto *E = new (ExpressionAllocator) CallExpression(MA, ReadsMemory);
+  E->setID(LastExpressionID++);
   FillInBasicExpressionInfo(I, E);
   return E;
 }
 
-FactorExpression *SSAPRE::
+Expression *SSAPREContext::
+CreateAggregateValueExpression(Instruction &I) {
+  auto EI = dyn_cast<ExtractValueInst>(&I);
+  auto Idxs = EI ? EI->getIndices() : cast<InsertValueInst>(I).getIndices();
+
+  auto *E = new (ExpressionAllocator) AggregateValueExpression(Idxs);
+  E->setID(LastExpressionID++);
+  FillInBasicExpressionInfo(I, E);
+
+  // Extracts out of constant aggregates and alike fold right away
+  Value *V = EI
+    ? SimplifyExtractValueInst(E->getOperand(0), Idxs, *DL, TLI, DT, AC)
+    : SimplifyInsertValueInst(E->getOperand(0), E->getOperand(1), Idxs,
+                              *DL, TLI, DT, AC);
+  if (auto *SE = CheckSimplificationResults(E, I, V))
+    return SE;
+
+  return E;
+}
+
+FactorExpression *SSAPREContext::
 CreateFactorExpression(const Expression &PE, const BasicBlock &B) {
   auto FE = new (ExpressionAllocator) FactorExpression(B);
+  FE->setID(LastExpressionID++);
 
   // The order we add these blocks is not important, since these blocks only
   // used to get proper Operands and Versions out of the Expression.
   for (auto S = pred_begin(&B), EE = pred_end(&B); S != EE; ++S) {
     auto PB = (BasicBlock *)*S;
-    FE->addPred(PB, FE->getVExprNum());
+    FE->addPred(PB);
 
     // Make sure this block is reachable and make bugpoint happy
     if (!ValueToExp[PB->getTerminator()]) FE->setVExpr(PB, GetBottom());
@@ -970,7 +1388,7 @@ CreateFactorExpression(const Expression &PE, const BasicBlock &B) {
   return FE;
 }
 
-Expression * SSAPRE::
+Expression * SSAPREContext::
 CreateExpression(Instruction &I) {
   if (I.isTerminator()) {
     return CreateIgnoredExpression(I);
@@ -980,19 +1398,19 @@ CreateExpression(Instruction &I) {
   switch (I.getOpcode()) {
   case Instruction::ExtractValue:
   case Instruction::InsertValue:
-    // E = performSymbolicAggrValueEvaluation(I);
+    E = CreateAggregateValueExpression(I);
     break;
   case Instruction::PHI:
     E = CreatePHIExpression(cast<PHINode>(I));
     break;
   case Instruction::Call:
-    // E = performSymbolicCallEvaluation(I);
+    E = CreateCallExpression(cast<CallInst>(I));
     break;
   case Instruction::Store:
-    // E = performSymbolicStoreEvaluation(I);
+    E = CreateStoreExpression(cast<StoreInst>(I));
     break;
   case Instruction::Load:
-    // E = performSymbolicLoadEvaluation(I);
+    E = CreateLoadExpression(cast<LoadInst>(I));
     break;
   case Instruction::Trunc:
   case Instruction::ZExt:
@@ -1010,7 +1428,7 @@ CreateExpression(Instruction &I) {
     break;
   case Instruction::ICmp:
   case Instruction::FCmp:
-    // E = performSymbolicCmpEvaluation(I);
+    E = CreateBasicExpression(I);
     break;
   case Instruction::Add:
   case Instruction::FAdd:
@@ -1127,7 +1545,7 @@ enum TokenPropagationSolverType {
 
 class TokenPropagationSolver {
   TokenPropagationSolverType TPST;
-  SSAPRE &O;
+  SSAPREContext &O;
   PHIFactorMap_t PHIFactorMap;
   PHITokenMap_t PHITokenMap;
   SrcPropMap_t SrcPropMap;
@@ -1136,7 +1554,7 @@ class TokenPropagationSolver {
 
 public:
   TokenPropagationSolver() = delete;
-  TokenPropagationSolver(TokenPropagationSolverType TPST, SSAPRE &O)
+  TokenPropagationSolver(TokenPropagationSolverType TPST, SSAPREContext &O)
     : TPST(TPST), O(O) {}
 
   void
@@ -1201,22 +1619,32 @@ public:
 
   void
   FinishPropagation(Token_t T, const PHINode *PHI) {
-    assert(!SrcKillMap[PHI] && "The Factor is already killed");
+    // Finish every propagation depth-first, the destinations are pushed in
+    // reverse so they are visited in the order they were added
+    PropDstVector_t Worklist;
+    Worklist.push_back({T, PHI});
 
-    if (!HasFactorFor(PHI)) CreateFactor(PHI, T);
-    PHITokenMap[PHI] = T;
+    while (!Worklist.empty()) {
+      auto PD = Worklist.pop_back_val();
+      T = PD.TOK;
+      PHI = PD.DST;
 
-    // Either Top or Bottom results in deletion of the Factor
-    SrcKillMap[PHI] = IsTopOrBottomTok(T);
+      assert(!SrcKillMap[PHI] && "The Factor is already killed");
 
-    FinishedMap[PHI] = true;
+      if (!HasFactorFor(PHI)) CreateFactor(PHI, T);
+      PHITokenMap[PHI] = T;
 
-    if (!SrcPropMap.count(PHI)) return;
+      // Either Top or Bottom results in deletion of the Factor
+      SrcKillMap[PHI] = IsTopOrBottomTok(T);
 
-    // Recursively finish every propagation
-    for (auto &PD : SrcPropMap[PHI]) {
-      auto R = CalculateToken(T, PD.TOK);
-      FinishPropagation(R, PD.DST);
+      FinishedMap[PHI] = true;
+
+      if (!SrcPropMap.count(PHI)) continue;
+
+      auto &DL = SrcPropMap[PHI];
+      for (auto DS = DL.rbegin(), DE = DL.rend(); DS != DE; ++DS) {
+        Worklist.push_back({CalculateToken(T, DS->TOK), DS->DST});
+      }
     }
   }
 
@@ -1347,6 +1775,83 @@ public:
   }
 };
 } // namespace phi_factoring
+
+// Max-flow/min-cut solver for the profile guided placement
+namespace min_cut {
+typedef uint64_t Capacity_t;
+
+const unsigned Source = 0;
+const unsigned Sink = 1;
+const Capacity_t Infinity = std::numeric_limits<Capacity_t>::max() / 4;
+
+Capacity_t
+AddCapacity(Capacity_t A, Capacity_t B) {
+  return std::min(Infinity, A + B < A ? Infinity : A + B);
+}
+
+class FlowGraph {
+  struct Edge {
+    unsigned To;
+    Capacity_t Cap;
+  };
+
+  // Every edge is immediately followed by its reverse one, so E ^ 1 is always
+  // the opposite of E
+  std::vector<Edge> Edges;
+  std::vector<SmallVector<unsigned, 4>> Adj;
+
+  // Marks nodes reachable from the source in the residual graph, fills
+  // Parent with the edges they were reached by
+  bool Reach(BitVector &Reached, std::vector<unsigned> &Parent) {
+    Reached.reset();
+    SmallVector<unsigned, 32> Worklist{Source};
+    Reached.set(Source);
+    for (unsigned i = 0; i < Worklist.size(); ++i) {
+      auto N = Worklist[i];
+      for (auto E : Adj[N]) {
+        auto To = Edges[E].To;
+        if (!Edges[E].Cap || Reached.test(To)) continue;
+        Reached.set(To);
+        Parent[To] = E;
+        Worklist.push_back(To);
+      }
+    }
+    return Reached.test(Sink);
+  }
+
+public:
+  FlowGraph(unsigned NumNodes) : Adj(NumNodes) {}
+
+  void addEdge(unsigned From, unsigned To, Capacity_t Cap) {
+    Adj[From].push_back(Edges.size());
+    Edges.push_back({To, Cap});
+    Adj[To].push_back(Edges.size());
+    Edges.push_back({From, 0});
+  }
+
+  // Saturates the shortest augmenting paths(Edmonds-Karp) and returns the
+  // source side of the minimal cut
+  BitVector solve() {
+    BitVector Reached(Adj.size());
+    std::vector<unsigned> Parent(Adj.size());
+    while (Reach(Reached, Parent)) {
+      Capacity_t Flow = Infinity;
+      for (auto N = Sink; N != Source; N = Edges[Parent[N] ^ 1].To)
+        Flow = std::min(Flow, Edges[Parent[N]].Cap);
+
+      // Infinite paths cannot be cut at all, this cannot happen as long as
+      // nothing but Factors hangs between source and sink
+      if (Flow == Infinity) break;
+
+      for (auto N = Sink; N != Source; N = Edges[Parent[N] ^ 1].To) {
+        Edges[Parent[N]].Cap -= Flow;
+        Edges[Parent[N] ^ 1].Cap += Flow;
+      }
+    }
+    return Reached;
+  }
+};
+} // namespace min_cut
 } // namespace ssapre
 } // namespace llvm
 
@@ -1354,11 +1859,12 @@ public:
 // Pass Implementation
 //===----------------------------------------------------------------------===//
 
-void SSAPRE::
+void SSAPREContext::
 Init(Function &F) {
   LastVariableVersion = VR_VariableLo;
   LastConstantVersion = VR_ConstantLo;
   LastIgnoredVersion  = VR_IgnoredLo;
+  LastExpressionID    = EID_First;
 
   for (auto &A : F.args()) {
     auto VAExp = CreateVariableExpression(A);
@@ -1371,8 +1877,13 @@ Init(Function &F) {
   AddSubstitution(GetBottom(), GetBottom());
 
   // Each block starts its count from N hundred thousands, this will allow us
-  // add instructions within wide DFS/SDFS range
-  unsigned ICountGrowth = 100000;
+  // add instructions within wide DFS/SDFS range. For huge functions the range
+  // is narrowed, so the numbering of the last block does not overflow.
+  unsigned NumInsts = 0;
+  for (auto &B : F) NumInsts += B.size();
+  unsigned ICountGrowth =
+    std::min(100000U, (std::numeric_limits<unsigned>::max() - NumInsts) /
+                      (unsigned)(F.size() + 1));
   unsigned ICount = ICountGrowth;
 
   DenseMap<const DomTreeNode *, unsigned> RPOOrdering;
@@ -1390,20 +1901,30 @@ Init(Function &F) {
 
     // Collect all the expressions
     for (auto &I : *B) {
-      // Create ProtoExpresison, this expression will not be versioned and used
-      // to bind Versioned Expressions of the same kind/class.
-      auto PE = CreateExpression(I);
-      for (auto &P : PExprToInsts) {
-        auto EP = P.getFirst();
-        if (PE->equals(*EP))
-          PE = (Expression *)EP;
+      // This is the real versioned expression
+      Expression *VE = CreateExpression(I);
+
+      // Find ProtoExpresison, this expression will not be versioned and used
+      // to bind Versioned Expressions of the same kind/class. At this point VE
+      // is not versioned either, so it serves as a lookup key and we create a
+      // new ProtoExpression only if there is none yet.
+      // A store is an occurrence of the loads it clobbers, it makes the
+      // stored value available to them.
+      Expression *PK = VE;
+      if (StoreExpression::classof(VE))
+        PK = CreateStoredLoadExpression(cast<StoreInst>(I));
+
+      auto PE = PExprTable.lookup(PK);
+      if (!PE) {
+        PE = PK != VE ? PK : CreateExpression(I);
+        PExprTable[PE] = PE;
       }
 
-      if (!PE->getProto() && !IgnoreExpression(PE)) {
-        PE->setProto(I.clone());
+      // Only the loads can serve as a Proto, a store is never cloned
+      if (!PE->getProto() && !IgnoreExpression(PE) &&
+          !StoreExpression::classof(VE)) {
+        PE->setProto(&I);
       }
-      // This is the real versioned expression
-      Expression *VE = CreateExpression(I);
 
       AddExpression(PE, VE, &I, B);
 
@@ -1425,13 +1946,23 @@ Init(Function &F) {
   }
 
   // Assign each instruction a DFS order number. This will be the main order
-  // we traverse DT in.
+  // we traverse DT in. The collection above handed out the IDs in RPO, they
+  // are renumbered in this order too.
+  std::vector<Expression *> VExprs;
+  VExprs.reserve(InstToVExpr.size());
   auto DFI = df_begin(DT->getRootNode());
   for (auto DFE = df_end(DT->getRootNode()); DFI != DFE; ++DFI) {
     auto B = DFI->getBlock();
     auto BlockRange = AssignDFSNumbers(B, ICount, &InstrDFS);
     ICount += BlockRange.second - BlockRange.first + ICountGrowth;
+
+    for (auto &I : *B) {
+      auto &ID = InstrID[&I];
+      VExprs.push_back(InstToVExpr[ID]);
+      ID = VExprs.size() - 1;
+    }
   }
+  InstToVExpr.swap(VExprs);
 
   // Now we need to create Reverse Sorted Dominator Tree, where siblings sorted
   // in the opposite to RPO order. This order will give us a clue, when during
@@ -1500,10 +2031,16 @@ Init(Function &F) {
                 });
     }
   }
+
+  // DT DFS in/out numbers answer the "is on the path" queries during Rename
+  DT->updateDFSNumbers();
 }
 
-void SSAPRE::
+void SSAPREContext::
 Fini() {
+  delete RPOT;
+  RPOT = nullptr;
+
   JoinBlocks.clear();
 
   ExpToValue.clear();
@@ -1521,10 +2058,14 @@ Fini() {
   FactorToPHI.clear();
   PHIToFactor.clear();
 
+  MemoryStateAtEnd.clear();
+
+  InstrID.clear();
   InstToVExpr.clear();
   VExprToInst.clear();
   ExprToPExpr.clear();
   PExprToVersions.clear();
+  PExprTable.clear();
   PExprToInsts.clear();
   PExprToBlocks.clear();
   PExprToVExprs.clear();
@@ -1532,15 +2073,62 @@ Fini() {
   BlockToFactors.clear();
   FactorToBlock.clear();
 
+  SpeculatedFactors.clear();
+
+  LiveIns[0].clear();
+  LiveIns[1].clear();
+  PressureLimited.clear();
+
   FExprs.clear();
+  FactorUsers.clear();
 
   Substitutions.clear();
+  SubstitutionParents.clear();
+  SubstitutionChildren.clear();
   KillList.clear();
+  KillSet.clear();
 
   ExpressionAllocator.Reset();
 }
 
-void SSAPRE::
+void SSAPREContext::
+RunPhase(StringRef Name, StringRef Description, function_ref<void()> Step) {
+  {
+    NamedRegionTimer T(Name, Description, TimerGroupName,
+                       TimerGroupDescription, TimePassesIsEnabled);
+    Step();
+  }
+
+  auto Memory = ExpressionAllocator.getTotalMemory();
+  PeakMemory = std::max(PeakMemory, Memory);
+
+  if (!SSAPREReportPhases) return;
+
+  // Only the buckets are counted, the sets and vectors stored in them are not
+  auto Values = ValueToExp.getMemorySize() + ExpToValue.getMemorySize() +
+                InstToVExpr.capacity() * sizeof(Expression *) +
+                VExprToInst.getMemorySize() + InstrID.getMemorySize() +
+                InstrDFS.getMemorySize() + InstrSDFS.getMemorySize();
+  auto PExprs = ExprToPExpr.getMemorySize() + PExprTable.getMemorySize() +
+                PExprToInsts.getMemorySize() + PExprToBlocks.getMemorySize() +
+                PExprToVExprs.getMemorySize() +
+                PExprToVersions.getMemorySize();
+  auto Factors = BlockToFactors.getMemorySize() +
+                 FactorToBlock.getMemorySize() + FactorUsers.getMemorySize() +
+                 FactorToPHI.getMemorySize() + PHIToFactor.getMemorySize();
+  auto Substs = Substitutions.getMemorySize() +
+                SubstitutionParents.getMemorySize() +
+                SubstitutionChildren.getMemorySize();
+
+  errs() << "SSAPRE " << Func->getName() << " after " << Description
+         << ": expressions " << Memory << " B, values " << Values
+         << " B, PEs " << PExprs << " B, Factors " << Factors
+         << " B, substitutions " << Substs << " B; "
+         << PExprToInsts.size() << " PEs, " << FExprs.size() << " Factors, "
+         << KillList.size() << " killed\n";
+}
+
+void SSAPREContext::
 FactorInsertionMaterialized() {
   using namespace phi_factoring;
   TokenPropagationSolver TokSolver(TPST_Accurate, *this);
@@ -1590,30 +2178,227 @@ FactorInsertionMaterialized() {
     AddFactor(F, T, B);
     MaterializeFactor(F, (PHINode *)PHI);
   }
+
+  // A PHI of loads is their Factor only if the location keeps each incoming
+  // value up to the end of its block. Otherwise the load's PHIs stay plain
+  // PHIs, those left would join nothing meaningful.
+  SmallPtrSet<const Expression *, 4> Clobbered;
+  for (auto B : JoinBlocks) {
+    for (auto F : BlockToFactors[B]) {
+      auto PE = F->getPExpr();
+      if (!LoadExpression::classof(PE) || Clobbered.count(PE)) continue;
+      if (!PE->getProto() || any_of(F->getPreds(), [&](const BasicBlock *P) {
+            return !IsMemoryStateOf(F->getVExpr((BasicBlock *)P),
+                                    GetClobberOnEdge(PE, P, B));
+          }))
+        Clobbered.insert(PE);
+    }
+  }
+
+  if (!Clobbered.empty()) {
+    for (auto B : JoinBlocks) {
+      auto List = BlockToFactors[B];
+      for (auto F : List)
+        if (Clobbered.count(F->getPExpr())) KillFactor(F);
+    }
+  }
 }
 
-void SSAPRE::
+void SSAPREContext::
 FactorInsertionRegular() {
   // Insert Factors for every PE
-  // Factors are inserted in two cases:
+  // Factors are inserted in three cases:
   //   - for each block in expressions IDF
+  //   - for each MemoryPhi a load observes, its memory state is an operand
+  //     that the MemoryPhi alters
   //   - for each phi of expression operand, which indicates expression
-  //     alteration(TODO, requires operand versioning)
+  //     alteration, this is not done(TODO). -ssapre-operand-versioning is a
+  //     workaround, OperandVersioning rewrites the expressions over PHIs of
+  //     their own block ahead of Init, no Factors are placed for them here
+
+  // Dominance frontiers are calculated once for the whole function and every
+  // PE's IDF is their closure over its occurrence blocks. The IDF calculator
+  // walks the dominator subtree of every definition instead, which is
+  // quadratic for the long chains of blocks once nearly every block defines
+  // its own expressions.
+  DenseMap<const BasicBlock *, SmallVector<BasicBlock *, 2>> DF;
+  for (auto B : *RPOT) {
+    if (B->getSinglePredecessor()) continue;
+    auto IDom = DT->getNode(B)->getIDom();
+    for (auto PB : predecessors(B)) {
+      auto R = DT->getNode(PB);
+      for (; R && R != IDom; R = R->getIDom()) {
+        auto &RDF = DF[R->getBlock()];
+        if (RDF.empty() || RDF.back() != B) RDF.push_back(B);
+      }
+    }
+  }
+
+  // The PEs and their definition blocks are collected up front, the
+  // dependents of a skipped PE are found by its index. The table is walked in
+  // PE ID order, which does not change from run to run.
+  SmallVector<const Expression *, 32> PEs;
+  SmallVector<const SmallPtrSet<BasicBlock *, 5> *, 32> PEBlocks;
   for (auto &P : PExprToInsts) {
-    auto &PE = P.getFirst();
+    auto PE = P.getFirst();
 
     // Do not Factor PHIs, obviously
     if (IgnoreExpression(PE) || PHIExpression::classof(PE)) continue;
 
-    // Each Expression occurrence's DF requires us to insert a Factor function,
-    // which is much like PHI function but for expressions.
-    SmallVector<BasicBlock *, 32> IDF;
-    ForwardIDFCalculator IDFs(*DT);
-    IDFs.setDefiningBlocks(PExprToBlocks[PE]);
-    // IDFs.setLiveInBlocks(BlocksWithDeadTerminators);
-    IDFs.calculate(IDF);
+    // The stores nobody reads back have nothing to move around
+    if (!PE->getProto()) continue;
+
+    if (!PExprToBlocks.count(PE)) continue;
+
+    PEs.push_back(PE);
+  }
+  for (auto PE : PEs) PEBlocks.push_back(&PExprToBlocks[PE]);
+
+  // Each Expression occurrence's DF requires us to insert a Factor function,
+  // which is much like PHI function but for expressions.
+  //
+  // Every Factor operand is a renaming step and a node of the graphs the later
+  // steps propagate over. The IDF closure walking the DF edges is work as well,
+  // so the budgets are checked per PE while its IDF is computed: a PE that
+  // does not fit goes without Factors and only its full redundancies are
+  // eliminated. Once the work budget is spent every following PE stops at its
+  // first step, the closure is never computed past the budget.
+  std::vector<SmallVector<BasicBlock *, 8>> IDFs(PEs.size());
+  BitVector Skipped(PEs.size());
+  unsigned PExprs = 0;
+  uint64_t Factors = 0, Work = InstrDFS.size();
+
+  // The IDF membership is stamped with the PE's number, this way we do not
+  // need to clear it between the PEs
+  DenseMap<const BasicBlock *, unsigned> InIDF;
+  unsigned IDFStamp = 0;
+
+  for (size_t i = 0, l = PEs.size(); i != l; ++i) {
+    auto &IDF = IDFs[i];
+    SmallVector<const BasicBlock *, 32> Worklist(PEBlocks[i]->begin(),
+                                                 PEBlocks[i]->end());
+    uint64_t Cost = 0;
+    bool OverBudget = false;
+    IDFStamp++;
+
+    // The blocks of the MemoryPhis get their Factors and are definitions for
+    // the closure just like the occurrences
+    if (LoadExpression::classof(PEs[i])) {
+      for (auto VE : PExprToVExprs[PEs[i]]) {
+        auto LE = dyn_cast<LoadExpression>(VE);
+        auto MP = LE ? dyn_cast_or_null<MemoryPhi>(LE->getMemDef()) : nullptr;
+        if (!MP) continue;
+
+        auto &Stamp = InIDF[MP->getBlock()];
+        if (Stamp == IDFStamp) continue;
+        Stamp = IDFStamp;
+        IDF.push_back(MP->getBlock());
+        Worklist.push_back(MP->getBlock());
+        Cost++;
+      }
+    }
+    while (!Worklist.empty() && !OverBudget) {
+      Cost++;
+      auto DFI = DF.find(Worklist.pop_back_val());
+      if (DFI == DF.end()) continue;
+      for (auto FB : DFI->second) {
+        auto &Stamp = InIDF[FB];
+        if (Stamp == IDFStamp) continue;
+        Stamp = IDFStamp;
+        IDF.push_back(FB);
+        Worklist.push_back(FB);
+        Cost += std::distance(pred_begin(FB), pred_end(FB));
+      }
+      OverBudget = Work + Cost > SSAPREMaxWork;
+    }
+
+    // The work is spent whether the PE fits or not
+    Work += Cost;
+    if (IDF.empty() && !OverBudget) continue;
+
+    if (OverBudget || PExprs + 1 > SSAPREMaxPExprs ||
+        Factors + IDF.size() > SSAPREMaxFactors) {
+      Skipped.set(i);
+      IDF.clear();
+      continue;
+    }
+
+    PExprs++;
+    Factors += IDF.size();
+  }
+
+  if (Skipped.any()) {
+    // The Factors of an expression over a skipped one would depend on operand
+    // versions nobody makes available, so the skip spreads to every such PE,
+    // transitively
+    DenseMap<const Expression *, size_t> PEIndex;
+    for (size_t i = 0, l = PEs.size(); i != l; ++i) PEIndex[PEs[i]] = i;
+
+    std::vector<SmallVector<size_t, 2>> Dependents(PEs.size());
+    for (size_t i = 0, l = PEs.size(); i != l; ++i) {
+      for (auto I : PExprToInsts[PEs[i]]) {
+        for (auto &O : I->operands()) {
+          auto OPE = ExprToPExpr.lookup(ValueToExp.lookup(O));
+          auto It = PEIndex.find(OPE);
+          if (It != PEIndex.end() && It->second != i)
+            Dependents[It->second].push_back(i);
+        }
+      }
+    }
+
+    // Only the PEs that would have had Factors count as skipped
+    unsigned NumSkipped = 0, NumFactored = PExprs;
+    SmallVector<size_t, 32> Worklist;
+    for (int i = Skipped.find_first(); i != -1; i = Skipped.find_next(i)) {
+      Worklist.push_back(i);
+      NumSkipped++;
+      NumFactored++;
+    }
+    while (!Worklist.empty()) {
+      for (auto D : Dependents[Worklist.pop_back_val()]) {
+        if (Skipped.test(D)) continue;
+        Skipped.set(D);
+        Worklist.push_back(D);
+        if (!IDFs[D].empty()) NumSkipped++;
+      }
+    }
+
+    // The PHIs matched as Factors of a skipped PE become plain PHIs again,
+    // without the rest of the PE's Factors they have nothing to join
+    for (auto B : JoinBlocks) {
+      auto List = BlockToFactors[B];
+      for (auto F : List) {
+        if (!F->getIsMaterialized()) continue;
+        auto It = PEIndex.find(F->getPExpr());
+        if (It != PEIndex.end() && Skipped.test(It->second)) KillFactor(F);
+      }
+    }
+
+    SSAPRESkippedPExprs += NumSkipped;
+    ORE->emit(OptimizationRemarkMissed(DEBUG_TYPE, "OverBudget",
+                                       Func->getSubprogram(),
+                                       &Func->getEntryBlock())
+              << "only full redundancies of "
+              << ore::NV("Skipped", NumSkipped) << " of "
+              << ore::NV("Expressions", NumFactored)
+              << " expressions are eliminated, the rest fit the budget of "
+              << ore::NV("MaxExpressions", (unsigned)SSAPREMaxPExprs)
+              << " expressions, "
+              << ore::NV("MaxFactors", (unsigned)SSAPREMaxFactors)
+              << " Factors and a work of "
+              << ore::NV("MaxWork", (unsigned)SSAPREMaxWork));
+  }
+
+  // Factors are created in the PEs' order
+  for (size_t i = 0, l = PEs.size(); i != l; ++i) {
+    if (Skipped.test(i)) continue;
+
+    auto PE = PEs[i];
+    auto &IDF = IDFs[i];
 
     for (const auto &B : IDF) {
+      // Calls are not available above the memory state they observe
+      if (!MemoryDefDominates(PE, B)) continue;
 
       // True if a Factor for this Expression with exactly the same arguments
       // exists. There are two possibilities for arguments equality, there
@@ -1643,7 +2428,7 @@ FactorInsertionRegular() {
   }
 }
 
-void SSAPRE::
+void SSAPREContext::
 FactorInsertion() {
   FactorInsertionMaterialized();
   DEBUG(PrintDebug("STEP 1: F-Insertion.Materialized"));
@@ -1652,7 +2437,7 @@ FactorInsertion() {
   DEBUG(PrintDebug("STEP 1: F-Insertion.Regular"));
 }
 
-void SSAPRE::
+void SSAPREContext::
 RenamePass() {
   // We assign SSA versions to each of 3 kinds of expressions:
   //   - Real expression
@@ -1672,9 +2457,21 @@ RenamePass() {
   // Path we walk during DFS
   BBVector_t Path;
 
+  // Every push onto a PExpr stack is recorded in the undo log, and every block
+  // on the Path remembers the log size upon its entry. When the walk leaves a
+  // block we unwind the log down to this mark, popping exactly the frames the
+  // block and its dominator subtree pushed.
+  SmallVector<const Expression *, 64> UndoLog;
+  SmallVector<size_t, 32> UndoMarks;
+
+  auto PushVExpr = [&](const Expression *PE, unsigned SDFS, Expression *VE) {
+    PExprToVExprStack[PE].push({SDFS, VE});
+    UndoLog.push_back(PE);
+  };
+
   // Init the stacks and counters
   for (auto &P : PExprToInsts) {
-    auto &PE = P.getFirst();
+    auto PE = P.getFirst();
     if (IgnoreExpression(PE)) continue;
 
     PExprToCounter.insert({PE, 0});
@@ -1688,25 +2485,23 @@ RenamePass() {
     // instruction's in the block
     auto FSDFS = InstrSDFS[&B->front()];
 
-    // Backtrack the path if necessary
-    while (!Path.empty() && InstrSDFS[&Path.back()->front()] > FSDFS)
+    // Backtrack the path and its stacks if necessary
+    while (!Path.empty() && InstrSDFS[&Path.back()->front()] > FSDFS) {
       Path.pop_back();
+      auto Mark = UndoMarks.pop_back_val();
+      while (UndoLog.size() > Mark)
+        PExprToVExprStack[UndoLog.pop_back_val()].pop();
+    }
 
     Path.push_back(B);
+    UndoMarks.push_back(UndoLog.size());
 
     // Set PHI versions first, since factors regarded as occurring at the end
     // of the predecessor blocks and PHIs go strictly before Factors
-    // NOTE Currently there is no need to version non-factored PHIs, since the
-    // only use for them would be to define an expression's operand, but without
-    // phi-ud graph this is useless
-    // NOTE resurect this when phi-ud is ready
-    // for (auto &I : *B) {
-    //   if (IsFactoredPHI(&I)) continue;
-    //   if (&I == B->getFirstNonPHI()) break;
-    //   auto &VE = InstToVExpr[&I];
-    //   auto &PE = ExprToPExpr[VE];
-    //   VE->setVersion(PExprToCounter[PE]++);
-    // }
+    // NOTE There is no need to version non-factored PHIs, the only use for
+    // them would be to define an expression's operand, and the expressions
+    // over PHIs are only matched through the phi-ud edges by
+    // OperandVersioning, if it is enabled
 
     // NOTE We want to stack MFactors specifically after the normal ones so the
     // NOTE expressions will assume their versions
@@ -1716,7 +2511,7 @@ RenamePass() {
       if (FE->getIsMaterialized()) continue;
       auto PE = FE->getPExpr();
       FE->setVersion(PExprToCounter[PE]++);
-      PExprToVExprStack[PE].push({FSDFS, FE});
+      PushVExpr(PE, FSDFS, FE);
     }
 
     // Then materialized ones
@@ -1724,26 +2519,21 @@ RenamePass() {
       if (!FE->getIsMaterialized()) continue;
       auto PE = FE->getPExpr();
       FE->setVersion(PExprToCounter[PE]++);
-      PExprToVExprStack[PE].push({FSDFS, FE});
+      PushVExpr(PE, FSDFS, FE);
     }
 
-    // And the rest of the instructions
+    // And the rest of the instructions, their IDs are consecutive
+    auto ID = InstrID.lookup(&B->front());
     for (auto &I : *B) {
+      assert(InstrID.lookup(&I) == ID && "Instruction IDs out of DFS order");
+      auto VE = InstToVExpr[ID++];
+
       // Skip already passed PHIs
       if (PHINode::classof(&I)) continue;
 
-      auto &VE = InstToVExpr[&I];
       auto &PE = ExprToPExpr[VE];
       auto SDFS = InstrSDFS[&I];
 
-      // Backtrace every stacks if we jumped up the tree
-      for (auto &P : PExprToVExprStack) {
-        auto &VEStack = P.getSecond();
-        while (!VEStack.empty() && VEStack.top().first > SDFS) {
-          VEStack.pop();
-        }
-      }
-
       // Do nothing for ignored expressions
       if (IgnoreExpression(VE)) continue;
 
@@ -1790,7 +2580,7 @@ RenamePass() {
       // Stack is empty
       if (!VEStackTop) {
         VE->setVersion(PExprToCounter[PE]++);
-        VEStack.push({SDFS, VE});
+        PushVExpr(PE, SDFS, VE);
 
       // Factor
       } else if (VEStackTopF) {
@@ -1805,7 +2595,7 @@ RenamePass() {
         // is indeed a new expression version
         } else {
           VE->setVersion(PExprToCounter[PE]++);
-          VEStack.push({SDFS, VE});
+          PushVExpr(PE, SDFS, VE);
 
           // STEP 3 Init: DownSafe
           // If the top of the stack contains a Factor expression and its
@@ -1825,7 +2615,7 @@ RenamePass() {
           //   new V
           //  ------------------
           //  If M == 0 we clear the %V's DownSafe flag
-          if (!FactorHasRealUseBefore(VEStackTopF, Path, VE)) {
+          if (!FactorHasRealUseBefore(VEStackTopF, VE)) {
             VEStackTopF->setDownSafe(false);
           }
         }
@@ -1847,12 +2637,22 @@ RenamePass() {
           }
         }
 
+        // A load also needs the same memory state, which a store always
+        // defines anew
+        if (SameVersions && (LoadExpression::classof(VE) ||
+                             StoreExpression::classof(VE))) {
+          SameVersions =
+              LoadExpression::classof(VE) &&
+              IsMemoryStateOf(VEStackTop,
+                              cast<LoadExpression>(VE)->getMemDef());
+        }
+
         if (SameVersions) {
           VE->setVersion(VEStackTop->getVersion());
           AddSubstitution(VE, VEStackTop);
         } else {
           VE->setVersion(PExprToCounter[PE]++);
-          VEStack.push({SDFS, VE});
+          PushVExpr(PE, SDFS, VE);
         }
       }
 
@@ -1867,7 +2667,18 @@ RenamePass() {
         auto PE = F->getPExpr();
         auto &VEStack = PExprToVExprStack[PE];
         auto VEStackTop = VEStack.empty() ? nullptr : VEStack.top().second;
-        auto VE = VEStack.empty() ? GetBottom() : VEStackTop;
+
+        // A load's value reaches the Factor only if nothing clobbers the
+        // location on the way. A Factor on top is then not anticipated past
+        // this block, unless it is used before.
+        if (VEStackTop && LoadExpression::classof(PE) &&
+            !IsMemoryStateOf(VEStackTop, GetClobberOnEdge(PE, B, S))) {
+          auto TF = dyn_cast<FactorExpression>(VEStackTop);
+          if (TF && !FactorHasRealUseBefore(TF, GetVExpr(T)))
+            TF->setDownSafe(false);
+          VEStackTop = nullptr;
+        }
+        auto VE = VEStackTop ? VEStackTop : GetBottom();
 
         // Linked Factor's operands are already versioned and set
         if (F->getIsMaterialized()) {
@@ -1886,15 +2697,19 @@ RenamePass() {
           if (FactorExpression::classof(VEStackTop)) {
             HasRealUse = FactorHasRealUseBefore(
                            (FactorExpression *)VEStackTop,
-                           Path,
-                           InstToVExpr[T]);
+                           GetVExpr(T));
+          // A load or a store holds the value of the location, it needs no
+          // use to be available
+          } else if (LoadExpression::classof(VEStackTop) ||
+                     StoreExpression::classof(VEStackTop)) {
+            HasRealUse = true;
           // If it is a real expression we check the usage directly
           } else if (BasicExpression::classof(VEStackTop)) {
-            HasRealUse = HasRealUseBefore(VEStackTop, Path, InstToVExpr[T]);
+            HasRealUse = HasRealUseBefore(VEStackTop, GetVExpr(T));
           }
         }
 
-        F->setHasRealUse(VE, HasRealUse);
+        F->setHasRealUse(B, HasRealUse);
       }
     }
 
@@ -1906,7 +2721,7 @@ RenamePass() {
         auto &VEStack = P.getSecond();
         if (VEStack.empty()) continue;
         if (auto *F = dyn_cast<FactorExpression>(VEStack.top().second)) {
-          if (!FactorHasRealUseBefore(F, Path, InstToVExpr[T]))
+          if (!FactorHasRealUseBefore(F, GetVExpr(T)))
             F->setDownSafe(false);
         }
       }
@@ -1914,7 +2729,7 @@ RenamePass() {
   }
 }
 
-void SSAPRE::
+void SSAPREContext::
 RenameCleaup() {
   SmallPtrSet<FactorExpression *, 32> FactorKillList;
 
@@ -1992,13 +2807,12 @@ RenameCleaup() {
   }
 
   for (auto F : FactorKillList) {
-    if (auto P = F->getProto()) P->dropAllReferences();
     KillFactor(F);
     AddSubstitution(F, GetTop());
   }
 }
 
-void SSAPRE::
+void SSAPREContext::
 RenameInductivityPass() {
   // TODO this whole induction thing is way too simple
   // This maps induction expressions to its cycle head we could find so far. We
@@ -2084,17 +2898,33 @@ RenameInductivityPass() {
 
   // Remove all stuff related
   for (auto F : FactorKillList) {
-
-    if (auto P = F->getProto()) P->dropAllReferences();
-
     auto PHI = FactorToPHI[F];
-    auto REP = PHI ? InstToVExpr[PHI] : GetTop();
+    auto REP = PHI ? GetVExpr(PHI) : GetTop();
     KillFactor(F);
     AddSubstitution(F, REP, /* direct */ true, /* force */ true);
   }
 }
 
-void SSAPRE::
+void SSAPREContext::
+RenameFactorGraph() {
+  // After Rename the Factors' operands are set, so we can record for every
+  // Factor the Factors that use it as an operand. This is the reverse of the
+  // Factor graph, used to propagate CanBeAvail and Later resets.
+  for (auto F : FExprs) {
+    for (auto VE : F->getVExprs()) {
+      auto G = dyn_cast_or_null<FactorExpression>(VE);
+      if (!G) continue;
+
+      // Multiple edges from the same Factor are recorded once, and since we
+      // process the operands of a single Factor at a time those are adjacent
+      auto &Users = FactorUsers[G];
+      if (Users.empty() || Users.back() != F)
+        Users.push_back(F);
+    }
+  }
+}
+
+void SSAPREContext::
 Rename() {
   RenamePass();
   DEBUG(PrintDebug("Rename.Pass"));
@@ -2102,9 +2932,10 @@ Rename() {
   DEBUG(PrintDebug("Rename.Cleanup"));
   RenameInductivityPass();
   DEBUG(PrintDebug("Rename.InductivityPass"));
+  RenameFactorGraph();
 }
 
-bool SSAPRE::
+bool SSAPREContext::
 IsInductionExpression(const Expression *E) {
   if (BasicExpression::classof(E)) {
     for (auto &I : VExprToInst[E]->operands()) {
@@ -2119,7 +2950,7 @@ IsInductionExpression(const Expression *E) {
   return false;
 }
 
-bool SSAPRE::
+bool SSAPREContext::
 IsInductionExpression(const FactorExpression *F, const Expression *E) {
   if (BasicExpression::classof(E)) {
     for (auto &I : VExprToInst[E]->operands()) {
@@ -2134,35 +2965,780 @@ IsInductionExpression(const FactorExpression *F, const Expression *E) {
   return false;
 }
 
-void SSAPRE::
-ResetDownSafety(FactorExpression *FE, Expression *E) {
-  if (FE->getHasRealUse(E) || !FactorExpression::classof(E)) {
-    return;
+bool SSAPREContext::
+IsTranslatable(const Instruction *I) {
+  // Only the pure computations, their value depends on nothing but operands
+  return isa<BinaryOperator>(I) || isa<CmpInst>(I) || isa<CastInst>(I) ||
+         isa<GetElementPtrInst>(I);
+}
+
+Value * SSAPREContext::
+GetAvailableTranslation(const Instruction *E, ArrayRef<Value *> Ops,
+                        const BasicBlock *P) {
+  // Any other occurrence of the translated expression uses its operands, so
+  // we only look through the users of the first one that is not a constant
+  auto O = find_if(Ops, [](const Value *V) { return !isa<Constant>(V); });
+  if (O == Ops.end()) return nullptr;
+
+  auto T = P->getTerminator();
+  for (auto U : (*O)->users()) {
+    auto C = dyn_cast<Instruction>(U);
+    if (!C || C == E || !C->isSameOperationAs(E)) continue;
+    if (!std::equal(Ops.begin(), Ops.end(), C->op_begin())) continue;
+    if (!DT->dominates(C, T)) continue;
+    return C;
   }
+  return nullptr;
+}
 
-  auto F = (FactorExpression *)E;
-  if (!F->getDownSafe())
-    return;
+bool SSAPREContext::
+OperandVersioning() {
+  // N.B.
+  // In the paper the expression's operands are versioned variables, and a PHI
+  // of an operand starts a new version of every expression that uses it, which
+  // calls for a Factor at the PHI's block. Here operands are distinct values,
+  // the expression over a PHI and the expressions over its incoming values are
+  // different prototypes and the Factor graph never connects them. Placing
+  // those Factors is still a TODO, as a workaround this step follows the
+  // phi-ud edges one block up: an expression that uses a PHI of its own block
+  // is translated into every predecessor, and if at least one of the
+  // translations is available there we replace it by a PHI of them, inserting
+  // the missing ones. The result is then a regular materialized Factor for the
+  // rest of the algorithm.
+  bool Changed = false;
+  for (auto B : *RPOT) {
+    if (pred_empty(B) ||
+        any_of(predecessors(B), [&](const BasicBlock *P) {
+          return !DT->isReachableFromEntry(P);
+        }))
+      continue;
 
-  F->setDownSafe(false);
-  for (auto VE : F->getVExprs()) {
-    ResetDownSafety(F, VE);
+    for (auto II = B->getFirstNonPHI()->getIterator(), IE = B->end();
+         II != IE;) {
+      auto E = &*II++;
+      if (!IsTranslatable(E)) continue;
+
+      // The phi-ud edges of this expression, the rest of the operands must be
+      // available in every predecessor as is
+      bool HasPHIOperand = false;
+      bool OperandsAvailable = true;
+      for (auto &O : E->operands()) {
+        auto I = dyn_cast<Instruction>(O.get());
+        if (!I) continue;
+        if (isa<PHINode>(I) && I->getParent() == B) {
+          HasPHIOperand = true;
+        } else if (!DT->properlyDominates(I->getParent(), B)) {
+          OperandsAvailable = false;
+          break;
+        }
+      }
+      if (!HasPHIOperand || !OperandsAvailable) continue;
+
+      SmallDenseMap<BasicBlock *, Value *, 4> Translations;
+      SmallVector<std::pair<BasicBlock *, SmallVector<Value *, 4>>, 4> Missing;
+      for (auto P : predecessors(B)) {
+        if (Translations.count(P)) continue;
+
+        SmallVector<Value *, 4> Ops;
+        for (auto &O : E->operands()) {
+          auto PHI = dyn_cast<PHINode>(O.get());
+          Ops.push_back(PHI && PHI->getParent() == B
+                        ? PHI->getIncomingValueForBlock(P) : O.get());
+        }
+
+        auto V = GetAvailableTranslation(E, Ops, P);
+        Translations[P] = V;
+        if (!V) Missing.push_back({P, Ops});
+      }
+
+      // Nothing is redundant
+      if (Missing.size() == Translations.size()) continue;
+
+      // The computations we insert must not trap and must not execute on the
+      // paths that do not lead to this block
+      if (!Missing.empty() &&
+          (!isSafeToSpeculativelyExecute(E) ||
+           any_of(Missing, [](const std::pair<BasicBlock *,
+                                              SmallVector<Value *, 4>> &M) {
+             return M.first->getTerminator()->getNumSuccessors() != 1;
+           })))
+        continue;
+
+      for (auto &M : Missing) {
+        auto I = E->clone();
+        for (unsigned i = 0, l = M.second.size(); i < l; ++i)
+          I->setOperand(i, M.second[i]);
+        I->insertBefore(M.first->getTerminator());
+        Translations[M.first] = I;
+        SSAPREInstrInserted++;
+        ReportInserted(I);
+      }
+
+      auto PHI = PHINode::Create(E->getType(), Translations.size(), "ssapre_phi",
+                                 &B->front());
+      for (auto P : predecessors(B)) {
+        auto V = Translations[P];
+        // The occurrence we reuse may carry flags the replaced one does not
+        if (auto I = dyn_cast<Instruction>(V)) I->andIRFlags(E);
+        PHI->addIncoming(V, P);
+      }
+      SSAPREPHIInserted++;
+      ReportPHIInserted(PHI, E);
+
+      E->replaceAllUsesWith(PHI);
+      ReportDeleted(E);
+      E->eraseFromParent();
+      SSAPREInstrKilled++;
+      Changed = true;
+    }
+  }
+
+  return Changed;
+}
+
+Value * SSAPREContext::
+GetAvailableLoadTranslation(const LoadInst *L, Value *Ptr,
+                            const MemoryAccess *MA, const BasicBlock *P) {
+  auto T = P->getTerminator();
+
+  // A store that clobbers the translated location writes exactly the value we
+  // would read there
+  if (auto MD = dyn_cast<MemoryDef>(MA)) {
+    auto SI = dyn_cast_or_null<StoreInst>(MD->getMemoryInst());
+    if (SI && SI->isSimple() && SI->getPointerOperand() == Ptr &&
+        SI->getValueOperand()->getType() == L->getType() &&
+        DT->dominates(SI, T))
+      return SI->getValueOperand();
+  }
+
+  // Otherwise a load of the same address under the same memory state
+  for (auto U : Ptr->users()) {
+    auto C = dyn_cast<LoadInst>(U);
+    if (!C || C == L || !C->isSimple() || C->getFunction() != Func) continue;
+    if (C->getPointerOperand() != Ptr || C->getType() != L->getType()) continue;
+    if (!DT->dominates(C, T) || !MSSA->getMemoryAccess(C)) continue;
+    if (MSSAWalker->getClobberingMemoryAccess(C) != MA) continue;
+    return C;
+  }
+  return nullptr;
+}
+
+bool SSAPREContext::
+MemoryVersioning() {
+  // N.B.
+  // Rename versions a load through the Factor at the block of the MemoryPhi
+  // it observes. StoreSinking runs ahead of that and only sinks the stores no
+  // load in the loop reads back, so this does the same as an IR rewrite
+  // before either of them: the load is translated into every predecessor of
+  // the MemoryPhi's block under the incoming access, and if at least one
+  // translation is available the load is replaced by a PHI of them at that
+  // block. That PHI then is a materialized Factor for the rest of the
+  // algorithm.
+  bool Changed = false;
+  MemorySSAUpdater Updater(MSSA);
+
+  // Every load of the same address and type under the same MemoryPhi reads the
+  // same value, the first one's PHI serves the rest
+  DenseMap<std::pair<const MemoryAccess *, const Value *>, PHINode *> Versioned;
+
+  for (auto B : *RPOT) {
+    for (auto II = B->begin(), IE = B->end(); II != IE;) {
+      auto L = dyn_cast<LoadInst>(&*II++);
+      if (!L || !L->isSimple()) continue;
+
+      auto LA = MSSA->getMemoryAccess(L);
+      if (!LA) continue;
+      auto MP = dyn_cast<MemoryPhi>(MSSAWalker->getClobberingMemoryAccess(L));
+      if (!MP) continue;
+
+      // The memory state reaching the end of a predecessor
+      auto GetIncomingAccess = [&](const BasicBlock *P) {
+        return MP->getIncomingValue(MP->getBasicBlockIndex(P));
+      };
+
+      auto H = MP->getBlock();
+      if (any_of(predecessors(H), [&](const BasicBlock *P) {
+            return !DT->isReachableFromEntry(P);
+          }))
+        continue;
+
+      // The address must be available in every predecessor as is, or be a PHI
+      // of the MemoryPhi's block itself and get translated as well
+      auto Ptr = L->getPointerOperand();
+      auto PtrPHI = dyn_cast<PHINode>(Ptr);
+      if (PtrPHI && PtrPHI->getParent() != H) PtrPHI = nullptr;
+      auto PtrI = dyn_cast<Instruction>(Ptr);
+      if (PtrI && !PtrPHI && !DT->properlyDominates(PtrI->getParent(), H))
+        continue;
+
+      auto &PHI = Versioned[{MP, Ptr}];
+      if (PHI && PHI->getType() != L->getType()) continue;
+
+      if (!PHI) {
+        auto Loc = MemoryLocation::get(L);
+        SmallDenseMap<BasicBlock *, Value *, 4> Translations;
+        SmallVector<std::pair<BasicBlock *, Value *>, 4> Missing;
+        unsigned Cycled = 0;
+        for (auto P : predecessors(H)) {
+          if (Translations.count(P)) continue;
+
+          auto PPtr = PtrPHI ? PtrPHI->getIncomingValueForBlock(P) : Ptr;
+          auto MA = MSSAWalker->getClobberingMemoryAccess(
+              GetIncomingAccess(P), Loc.getWithNewPtr(PPtr));
+
+          // Nothing writes the location on the way back to the MemoryPhi, the
+          // value is the load's own one, which the PHI stands for
+          if (MA == MP && PPtr == Ptr) {
+            Translations[P] = L;
+            Cycled++;
+            continue;
+          }
+
+          auto V = GetAvailableLoadTranslation(L, PPtr, MA, P);
+          Translations[P] = V;
+          if (!V) Missing.push_back({P, PPtr});
+        }
+
+        // Nothing is redundant
+        if (Missing.size() + Cycled == Translations.size()) continue;
+
+        // The loads we insert execute on every path into the block, only the
+        // loads of the block itself are anticipated there, and they must not
+        // fault
+        if (!Missing.empty() &&
+            (L->getParent() != H ||
+             any_of(Missing, [&](const std::pair<BasicBlock *, Value *> &M) {
+               auto T = M.first->getTerminator();
+               return T->getNumSuccessors() != 1 ||
+                      !isSafeToLoadUnconditionally(M.second,
+                                                   L->getAlignment(), *DL, T,
+                                                   DT);
+             })))
+          continue;
+
+        for (auto &M : Missing) {
+          auto I = cast<LoadInst>(L->clone());
+          I->setOperand(0, M.second);
+          I->insertBefore(M.first->getTerminator());
+          Updater.createMemoryAccessInBB(I, GetIncomingAccess(M.first),
+                                         M.first, MemorySSA::End);
+          Translations[M.first] = I;
+          SSAPREInstrInserted++;
+          ReportInserted(I);
+        }
+
+        PHI = PHINode::Create(L->getType(), Translations.size(), "ssapre_phi",
+                              &H->front());
+        for (auto P : predecessors(H)) {
+          auto V = Translations[P];
+          PHI->addIncoming(V == L ? PHI : V, P);
+        }
+        SSAPREPHIInserted++;
+        ReportPHIInserted(PHI, L);
+      }
+
+      L->replaceAllUsesWith(PHI);
+      Updater.removeMemoryAccess(LA);
+      ReportDeleted(L);
+      L->eraseFromParent();
+      SSAPREInstrKilled++;
+      Changed = true;
+    }
+  }
+
+  return Changed;
+}
+
+bool SSAPREContext::
+IsSinkableStoreLoop(const Loop *L, const Value *Ptr,
+                    ArrayRef<StoreInst *> Stores,
+                    SmallVectorImpl<std::pair<LoadInst *, StoreInst *>> &Loads) {
+  auto T = Stores.front()->getValueOperand()->getType();
+  if (any_of(Stores, [&](const StoreInst *S) {
+        return S->getValueOperand()->getType() != T;
+      }))
+    return false;
+
+  // Nothing else in the loop may read or write the location, the stores are
+  // moved past all of it. The loads that read one of the stores directly are
+  // the exception, they get the stored value. Every store writes the same
+  // location, the first one speaks for the rest when we ask the walker whether
+  // it clobbers a location.
+  SmallPtrSet<const Instruction *, 4> Group(Stores.begin(), Stores.end());
+  auto SD = MSSA->getMemoryAccess(Stores.front());
+  auto Touches = [&](const MemoryLocation &Loc) {
+    return MSSAWalker->getClobberingMemoryAccess(SD, Loc) == SD;
+  };
+
+  for (auto B : L->blocks()) {
+    for (auto &I : *B) {
+      // Leaving the loop any other way than through its exits, e.g. by a call
+      // that unwinds, would skip the sunk stores
+      if (!isGuaranteedToTransferExecutionToSuccessor(&I)) return false;
+      if (Group.count(&I) || !MSSA->getMemoryAccess(&I)) continue;
+      if (auto LI = dyn_cast<LoadInst>(&I)) {
+        if (!LI->isSimple()) return false;
+        auto MD = dyn_cast<MemoryDef>(MSSAWalker->getClobberingMemoryAccess(LI));
+        auto SI = MD ? dyn_cast_or_null<StoreInst>(MD->getMemoryInst())
+                     : nullptr;
+        if (SI && Group.count(SI) && LI->getPointerOperand() == Ptr &&
+            LI->getType() == T)
+          Loads.push_back({LI, SI});
+        else if (Touches(MemoryLocation::get(LI)))
+          return false;
+      } else if (auto SI = dyn_cast<StoreInst>(&I)) {
+        if (!SI->isSimple() || Touches(MemoryLocation::get(SI))) return false;
+      } else {
+        // Calls, fences and the like, the walker does not tell us whether
+        // they only read the location
+        return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+bool SSAPREContext::
+StoreSinking() {
+  // N.B.
+  // A store inside a loop that nothing in the loop reads is partially dead,
+  // the next iteration overwrites it and only the value of the last one is
+  // observable after the loop. We sink such stores to the loop exits, the
+  // stored value is carried around the loop in a register instead, i.e. the
+  // location is promoted. The loads of the location that read a store of the
+  // same iteration get its value, the ones that read the previous iteration's
+  // store are versioned by MemoryVersioning before we get here. A loop where
+  // such a load is left, e.g. without -ssapre-memory-versioning, keeps its
+  // stores.
+  //
+  // This is not SSAPRE over stores, the stores never enter the Factor graph
+  // and nothing here looks at partially dead stores outside of loops. It is a
+  // workaround until they do.
+  //
+  // Unlike LICM we do not need a single store that dominates every exit, an
+  // exit qualifies if a store executes on every path into it within an
+  // iteration, no matter which one. At an exit that is not reached through a
+  // store we would have to write the value the location had before the loop,
+  // a store the program does not execute on that path, which is only fine if
+  // no one else can observe the location.
+  bool Changed = false;
+  MemorySSAUpdater Updater(MSSA);
+  LoopInfo LI(*DT);
+
+  // Inner loops first, their stores may move out of the outer loops as well
+  auto Loops = LI.getLoopsInPreorder();
+  for (auto L : reverse(Loops)) {
+    auto Preheader = L->getLoopPreheader();
+    if (!Preheader || !L->hasDedicatedExits()) continue;
+
+    SmallVector<BasicBlock *, 4> Exits;
+    L->getUniqueExitBlocks(Exits);
+    if (Exits.empty() || any_of(Exits, [](const BasicBlock *E) {
+          return E->isEHPad();
+        }))
+      continue;
+
+    MapVector<Value *, SmallVector<StoreInst *, 4>> Candidates;
+    for (auto B : L->blocks())
+      for (auto &I : *B)
+        if (auto S = dyn_cast<StoreInst>(&I))
+          if (S->isSimple() && L->isLoopInvariant(S->getPointerOperand()))
+            Candidates[S->getPointerOperand()].push_back(S);
+
+    for (auto &C : Candidates) {
+      auto Ptr = C.first;
+      auto &Stores = C.second;
+      SmallVector<std::pair<LoadInst *, StoreInst *>, 4> Loads;
+      if (!IsSinkableStoreLoop(L, Ptr, Stores, Loads)) continue;
+
+      // The blocks a store executes in on every path from the header to their
+      // end, starting out with every block and shrinking to the fixed point
+      DenseMap<const BasicBlock *, bool> Stored;
+      SmallPtrSet<const BasicBlock *, 4> StoreBlocks;
+      for (auto S : Stores) StoreBlocks.insert(S->getParent());
+      for (auto B : L->blocks()) Stored[B] = true;
+      for (bool Changing = true; Changing;) {
+        Changing = false;
+        for (auto B : L->blocks()) {
+          auto In = B != L->getHeader() &&
+                    all_of(predecessors(B), [&](const BasicBlock *P) {
+                      return Stored.lookup(P);
+                    });
+          auto Out = In || StoreBlocks.count(B);
+          if (Stored[B] == Out) continue;
+          Stored[B] = Out;
+          Changing = true;
+        }
+      }
+
+      auto Covered = [&](const BasicBlock *E) {
+        return all_of(predecessors(E), [&](const BasicBlock *P) {
+          return Stored.lookup(P);
+        });
+      };
+
+      auto First = Stores.front();
+      // No alignment stands for the ABI one, which may well be the larger
+      auto T = First->getValueOperand()->getType();
+      auto GetAlignment = [&](const StoreInst *S) {
+        auto A = S->getAlignment();
+        return A ? A : DL->getABITypeAlignment(T);
+      };
+      unsigned Align = GetAlignment(First);
+      for (auto S : Stores) Align = std::min(Align, GetAlignment(S));
+
+      // An exit not reached through a store gets the value from before the
+      // loop, the location must be invisible to anyone else and safe to read
+      LoadInst *Init = nullptr;
+      if (!all_of(Exits, Covered)) {
+        auto Obj = GetUnderlyingObject(Ptr, *DL);
+        if (!isa<AllocaInst>(Obj) ||
+            PointerMayBeCaptured(Obj, /* ReturnCaptures */ true,
+                                 /* StoreCaptures */ true) ||
+            !isSafeToLoadUnconditionally(Ptr, Align, *DL,
+                                         Preheader->getTerminator(), DT))
+          continue;
+
+        Init = new LoadInst(Ptr, "", false, Align, Preheader->getTerminator());
+        auto MU = Updater.createMemoryAccessInBB(Init, nullptr, Preheader,
+                                                 MemorySSA::End);
+        Updater.insertUse(cast<MemoryUse>(MU));
+        SSAPREInstrInserted++;
+        ReportInserted(Init);
+      }
+
+      // A stored value may be one of these loads itself, by the time we read
+      // the stores' values below they are replaced as well
+      for (auto &LS : Loads) {
+        LS.first->replaceAllUsesWith(LS.second->getValueOperand());
+        Updater.removeMemoryAccess(MSSA->getMemoryAccess(LS.first));
+        ReportDeleted(LS.first);
+        LS.first->eraseFromParent();
+        SSAPREInstrKilled++;
+      }
+
+      SmallVector<PHINode *, 8> PHIs;
+      SSAUpdater SSA(&PHIs);
+      SSA.Initialize(T, "ssapre_phi");
+      if (Init) SSA.AddAvailableValue(Preheader, Init);
+      // The stores are in program order within a block, the last one wins
+      for (auto S : Stores)
+        SSA.AddAvailableValue(S->getParent(), S->getValueOperand());
+
+      for (auto E : Exits) {
+        auto V = SSA.GetValueInMiddleOfBlock(E);
+        auto I = new StoreInst(V, Ptr, false, Align, &*E->getFirstInsertionPt());
+        I->setDebugLoc(First->getDebugLoc());
+        auto MD = Updater.createMemoryAccessInBB(I, nullptr, E,
+                                                 MemorySSA::Beginning);
+        Updater.insertDef(cast<MemoryDef>(MD), /* RenameUses */ true);
+        SSAPREInstrInserted++;
+        ReportInserted(I);
+      }
+      SSAPREPHIInserted += PHIs.size();
+
+      for (auto S : Stores) {
+        Updater.removeMemoryAccess(MSSA->getMemoryAccess(S));
+        ReportDeleted(S);
+        S->eraseFromParent();
+        SSAPREInstrKilled++;
+      }
+      SSAPREStoresSunk += Stores.size();
+      Changed = true;
+    }
+  }
+
+  return Changed;
+}
+
+void SSAPREContext::
+ResetDownSafety(FactorExpression *G) {
+  // The flag itself serves as the visited mark, thus every Factor is pushed on
+  // the worklist once and every edge is touched once per reset.
+  FEVector_t Worklist;
+  G->setDownSafe(false);
+  Worklist.push_back(G);
+
+  while (!Worklist.empty()) {
+    auto F = Worklist.pop_back_val();
+    for (auto P : F->getPreds()) {
+      if (F->getHasRealUse(P)) continue;
+
+      auto O = dyn_cast<FactorExpression>(F->getVExpr(P));
+      if (!O || !O->getDownSafe()) continue;
+
+      O->setDownSafe(false);
+      Worklist.push_back(O);
+    }
   }
 }
 
-void SSAPRE::
+void SSAPREContext::
 DownSafety() {
   // Here we propagate DownSafety flag initialized during Step 2 up the Factor
   // graph for each expression
   for (auto F : FExprs) {
     if (F->getDownSafe()) continue;
-    for (auto VE : F->getVExprs()) {
-      ResetDownSafety(F, VE);
+    ResetDownSafety(F);
+  }
+}
+
+bool SSAPREContext::
+CanSpeculate(FactorExpression *F) {
+  // Cycled Factors have their own hoisting rules, and materialized ones do not
+  // depend on DownSafety at all
+  if (F->getAnyCycles() || F->getIsMaterialized()) return false;
+
+  auto Proto = F->getPExpr()->getProto();
+  if (!Proto) return false;
+
+  // Speculation pays off only if it makes some real occurrence redundant
+  if (none_of(GetSameVExpr(F), [&](Expression *VE) {
+        return !FactorExpression::classof(VE) &&
+               GetSubstitution(VE, /* direct */ true) == F;
+      }))
+    return false;
+
+  // Every ⊥ and every unused Factor that will not be anticipated causes an
+  // insertion on its edge
+  unsigned Insertions = 0;
+  SmallVector<BasicBlock *, 4> InsertionBlocks;
+  for (auto P : F->getPreds()) {
+    auto VE = F->getVExpr(P);
+    auto O = dyn_cast<FactorExpression>(VE);
+    if (IsBottom(VE) ||
+        (O && !F->getHasRealUse(P) && !O->getDownSafe())) {
+      Insertions++;
+      InsertionBlocks.push_back(P);
+    }
+  }
+  if (Insertions > SSAPRESpeculationThreshold) return false;
+
+  for (auto B : InsertionBlocks) {
+    auto T = B->getTerminator();
+
+    // The inserted computations must be able to use the operands at the end of
+    // their blocks
+    if (!OperandsDominateStrictly(Proto, GetVExpr(T))) return false;
+
+    // No division by zero, no loads from possibly invalid addresses and no
+    // calls that may have side effects at the insertion point
+    if (!isSafeToSpeculativelyExecute(Proto, T, DT)) return false;
+  }
+
+  // With the profile speculate only if the inserted computations execute less
+  // often than the ones they make redundant
+  if (BFI) {
+    uint64_t Cost = 0;
+    for (auto B : InsertionBlocks)
+      Cost = min_cut::AddCapacity(Cost, GetFrequency(B));
+    if (Cost > GetRedundantFrequency(F)) return false;
+  }
+
+  return true;
+}
+
+void SSAPREContext::
+Speculate() {
+  // A Factor that is not DownSafe is normally dropped since its value is not
+  // anticipated on every path leaving it, but if evaluating the expression on
+  // such a path is cheap and harmless we can place it anyway
+  FEVector_t Speculated;
+  for (auto F : FExprs) {
+    if (F->getDownSafe() || !CanSpeculate(F)) continue;
+    Speculated.push_back(F);
+  }
+
+  // Set the flags once all the decisions are made, otherwise the insertion
+  // estimates of the later Factors would depend on the order
+  for (auto F : Speculated) {
+    F->setDownSafe(true);
+    SpeculatedFactors.insert(F);
+  }
+}
+
+// Integers and pointers go to the general purpose registers, floating point
+// values share the vector ones on the targets we care about
+static unsigned
+GetRegisterClass(const Type *T) {
+  return T->isVectorTy() || T->isFPOrFPVectorTy() ? 1 : 0;
+}
+
+bool SSAPREContext::
+ComputeLiveIns() {
+  // A value is live into every block on a path from one of its uses up to its
+  // definition, which is the only thing the pressure estimate needs. Every
+  // value walks its own blocks, so the walk has a budget of its own.
+  auto Account = [&](const Value *V, const BasicBlock *DefB) {
+    auto T = V->getType();
+    if (T->isVoidTy() || T->isTokenTy() || !T->isFirstClassType()) return;
+
+    auto &Counts = LiveIns[GetRegisterClass(T)];
+    SmallPtrSet<const BasicBlock *, 8> Visited;
+    SmallVector<const BasicBlock *, 8> Worklist;
+    for (auto &U : V->uses()) {
+      PressureWork++;
+      auto I = cast<Instruction>(U.getUser());
+      auto B = I->getParent();
+      if (auto PHI = dyn_cast<PHINode>(I)) {
+        // The value is live out of the incoming block only
+        B = PHI->getIncomingBlock(U);
+        if (B == DefB) continue;
+        if (Visited.insert(B).second) Worklist.push_back(B);
+        continue;
+      }
+
+      if (B != DefB && Visited.insert(B).second) Worklist.push_back(B);
+    }
+
+    while (!Worklist.empty()) {
+      auto B = Worklist.pop_back_val();
+      Counts[B]++;
+      for (auto P : predecessors(B)) {
+        PressureWork++;
+        if (P != DefB && Visited.insert(P).second) Worklist.push_back(P);
+      }
+    }
+  };
+
+  for (auto &A : Func->args()) Account(&A, nullptr);
+  for (auto &B : *Func) {
+    for (auto &I : B) {
+      Account(&I, &B);
+      if (PressureWork > SSAPREMaxPressureWork) return false;
+    }
+  }
+  return true;
+}
+
+bool SSAPREContext::
+ExceedsRegisterBudget(FactorExpression *F) {
+  auto Proto = F->getPExpr()->getProto();
+  if (!Proto) return false;
+
+  // A Factor that replaces no real occurrence only hands its value over to
+  // the Factors using it, those carry it on to the occurrences and are checked
+  // on their own. Rejecting this one would move the insertions to its users'
+  // edges without shortening any live range that reaches a real use.
+  if (none_of(GetSameVExpr(F), [&](Expression *VE) {
+        return !FactorExpression::classof(VE) &&
+               GetSubstitution(VE, /* direct */ true) == F;
+      }))
+    return false;
+
+  auto C = GetRegisterClass(Proto->getType());
+  unsigned Budget = TTI->getNumberOfRegisters(/* Vector */ C == 1);
+  if (!Budget) return false;
+
+  // If the Factor becomes available its value is live from its block down to
+  // every real occurrence it replaces, and through the whole cycle if it is
+  // cycled. The occurrences would otherwise compute the value on the spot.
+  auto FB = FactorToBlock[F];
+  SmallPtrSet<const BasicBlock *, 8> Visited;
+  SmallVector<const BasicBlock *, 8> Worklist;
+  Visited.insert(FB);
+
+  for (auto VE : GetSameVExpr(F)) {
+    if (FactorExpression::classof(VE)) continue;
+    if (GetSubstitution(VE, /* direct */ true) != F) continue;
+    auto B = VExprToInst[VE]->getParent();
+    if (Visited.insert(B).second) Worklist.push_back(B);
+  }
+
+  for (auto P : F->getPreds()) {
+    if (F->getIsCycle(F->getVExpr(P)) && Visited.insert(P).second)
+      Worklist.push_back(P);
+  }
+
+  while (!Worklist.empty()) {
+    auto B = Worklist.pop_back_val();
+    for (auto P : predecessors(B)) {
+      PressureWork++;
+      if (Visited.insert(P).second) Worklist.push_back(P);
     }
   }
+
+  auto &Counts = LiveIns[C];
+  if (any_of(Visited, [&](const BasicBlock *B) {
+        return Counts.lookup(B) >= Budget;
+      }))
+    return true;
+
+  // Account the new live range so the following decisions see it
+  for (auto B : Visited) Counts[B]++;
+  return false;
+}
+
+void SSAPREContext::
+LimitRegisterPressure() {
+  if (FExprs.empty()) return;
+
+  // Without the complete estimate nothing is limited, over the work budget the
+  // Factors keep the availability they have
+  PressureWork = 0;
+  auto OverBudget = [&] {
+    SSAPREPressureOverBudget++;
+    ORE->emit(OptimizationRemarkMissed(DEBUG_TYPE, "PressureOverBudget",
+                                       Func->getSubprogram(),
+                                       &Func->getEntryBlock())
+              << "register pressure is not limited, estimating it exceeds the "
+              << "work budget of "
+              << ore::NV("Budget", (unsigned)SSAPREMaxPressureWork));
+  };
+
+  if (!ComputeLiveIns()) {
+    LiveIns[0].clear();
+    LiveIns[1].clear();
+    OverBudget();
+    return;
+  }
+
+  // Only the Factors that will be available extend any live range. Every
+  // accepted one adds to the estimate the next decisions see, so they go in
+  // a fixed order: by block and then by PE.
+  FEVector_t Factors;
+  for (auto F : FExprs) {
+    // Materialized Factors are existing PHIs, they do not extend anything
+    if (F->getIsMaterialized() || !F->getWillBeAvail()) continue;
+    Factors.push_back(F);
+  }
+  std::sort(Factors.begin(), Factors.end(),
+            [&](const FactorExpression *A, const FactorExpression *B) {
+              auto AD = InstrDFS.lookup(&FactorToBlock[A]->front());
+              auto BD = InstrDFS.lookup(&FactorToBlock[B]->front());
+              if (AD != BD) return AD < BD;
+              return A->getPExpr()->getID() < B->getPExpr()->getID();
+            });
+
+  bool Reset = false;
+  for (auto F : Factors) {
+    if (PressureWork > SSAPREMaxPressureWork) {
+      OverBudget();
+      break;
+    }
+
+    // A Factor rejected before might have taken this one along
+    if (!F->getWillBeAvail()) continue;
+    if (!ExceedsRegisterBudget(F)) continue;
+
+    PressureLimited.insert(F);
+
+    // Cycles are dealt with in the bottom-up walk, the rest are made
+    // unavailable; their available users then insert the computation at the
+    // edge instead, which shortens the live range to that edge
+    if (!F->getAnyCycles()) {
+      ResetCanBeAvail(F);
+      Reset = true;
+    }
+  }
+
+  // The users of a rejected Factor see ⊥ in its place now, which might let
+  // them be later
+  if (Reset) ComputeLater();
 }
 
-void SSAPRE::
+void SSAPREContext::
 ComputeCanBeAvail() {
   for (auto F : FExprs) {
     if (!F->getDownSafe() && F->getCanBeAvail()) {
@@ -2176,35 +3752,48 @@ ComputeCanBeAvail() {
   }
 }
 
-void SSAPRE::
+void SSAPREContext::
 ResetCanBeAvail(FactorExpression *G) {
+  FEVector_t Worklist;
   G->setCanBeAvail(false);
-  for (auto F : FExprs) {
-    if (F->hasVExpr(G) && !F->getHasRealUse(G)) {
+  Worklist.push_back(G);
 
-      // If it happens to be a cycle clear the flag
-      if (F->getIsCycle(G)) {
-        F->setIsCycle(G, false);
-      }
+  while (!Worklist.empty()) {
+    G = Worklist.pop_back_val();
+    for (auto F : FactorUsers[G]) {
+      // The operand could have been replaced since the graph was built
+      bool Reset = false;
+      for (auto P : F->getPreds()) {
+        if (F->getVExpr(P) != G || F->getHasRealUse(P)) continue;
 
-      F->replaceVExpr(G, GetBottom());
+        // If it happens to be a cycle clear the flag
+        if (F->getIsCycle(G)) {
+          F->setIsCycle(G, false);
+        }
+
+        F->setVExpr(P, GetBottom());
+        Reset = true;
+      }
+      if (!Reset) continue;
 
       if (!F->getDownSafe() && F->getCanBeAvail()) {
-        ResetCanBeAvail(F);
+        F->setCanBeAvail(false);
+        Worklist.push_back(F);
       }
     }
   }
 }
 
-void SSAPRE::
+void SSAPREContext::
 ComputeLater() {
   for (auto F : FExprs) {
     F->setLater(F->getCanBeAvail());
   }
   for (auto F : FExprs) {
     if (F->getLater()) {
-      for (auto VE : F->getVExprs()) {
-        if ((F->getHasRealUse(VE) || F->getIsCycle(VE)) && !IsBottom(VE)) {
+      for (auto P : F->getPreds()) {
+        auto VE = F->getVExpr(P);
+        if ((F->getHasRealUse(P) || F->getIsCycle(VE)) && !IsBottom(VE)) {
           ResetLater(F);
           break;
         }
@@ -2213,21 +3802,147 @@ ComputeLater() {
   }
 }
 
-void SSAPRE::
+void SSAPREContext::
 ResetLater(FactorExpression *G) {
+  FEVector_t Worklist;
   G->setLater(false);
-  for (auto F : FExprs) {
-    if (F->hasVExpr(G) && F->getLater()) ResetLater(F);
+  Worklist.push_back(G);
+
+  while (!Worklist.empty()) {
+    G = Worklist.pop_back_val();
+    for (auto F : FactorUsers[G]) {
+      if (!F->getLater()) continue;
+
+      // The operand could have been replaced since the graph was built
+      for (auto P : F->getPreds()) {
+        if (F->getVExpr(P) != G) continue;
+        F->setLater(false);
+        Worklist.push_back(F);
+        break;
+      }
+    }
   }
 }
 
-void SSAPRE::
+void SSAPREContext::
 WillBeAvail() {
   ComputeCanBeAvail();
   ComputeLater();
 }
 
-void SSAPRE::
+uint64_t SSAPREContext::
+GetFrequency(const BasicBlock *B) {
+  return BFI->getBlockFreq(B).getFrequency();
+}
+
+uint64_t SSAPREContext::
+GetRedundantFrequency(FactorExpression *F) {
+  // The real occurrences of the Factor's version are all directly substituted
+  // by it, but only the ones not dominated by another such occurrence would
+  // compute anything if the Factor is not available
+  SmallVector<const Instruction *, 8> Computed;
+  uint64_t Freq = 0;
+  for (auto VE : GetSameVExpr(F)) {
+    if (FactorExpression::classof(VE)) continue;
+    if (GetSubstitution(VE, /* direct */ true) != F) continue;
+
+    auto I = VExprToInst[VE];
+    if (any_of(Computed, [&](const Instruction *C) {
+          return DT->dominates(C, I);
+        }))
+      continue;
+
+    Computed.push_back(I);
+    Freq = min_cut::AddCapacity(Freq, GetFrequency(I->getParent()));
+  }
+  return Freq;
+}
+
+void SSAPREContext::
+MinCutPlacement() {
+  using namespace min_cut;
+
+  DenseMap<const Expression *, SmallVector<FactorExpression *, 8>> PEFactors;
+  for (auto F : FExprs) PEFactors[F->getPExpr()].push_back(F);
+
+  for (auto &P : PEFactors) {
+    auto PE = P.getFirst();
+    auto &Factors = P.getSecond();
+
+    // The placement speculates computations, so only the expressions that are
+    // safe to compute anywhere qualify. Cycles and PHIs are left to the
+    // regular algorithm.
+    auto Proto = PE->getProto();
+    if (!Proto || !isSafeToSpeculativelyExecute(Proto)) continue;
+    if (any_of(Factors, [&](const FactorExpression *F) {
+          return F->getAnyCycles() || F->getIsMaterialized() ||
+                 PressureLimited.count(F);
+        }))
+      continue;
+
+    // Each Factor is a node, a Factor on the sink side of the cut is available.
+    // The cut edges are either insertions at the predecessors or the real
+    // occurrences that keep computing because their Factor is not available.
+    DenseMap<const FactorExpression *, unsigned> FactorNode;
+    for (auto F : Factors) {
+      auto N = FactorNode.size() + 2;
+      FactorNode[F] = N;
+    }
+
+    auto GetNode = [&](const FactorExpression *F) {
+      auto It = FactorNode.find(F);
+      assert(It != FactorNode.end() && "Factor of another expression");
+      return It->second;
+    };
+
+    FlowGraph G(Factors.size() + 2);
+    for (auto F : Factors) {
+      auto N = GetNode(F);
+
+      if (auto Freq = GetRedundantFrequency(F)) G.addEdge(N, Sink, Freq);
+
+      // We cannot insert anything for this one, so it is never available
+      if (!OperandsDominate(Proto, F)) {
+        G.addEdge(Source, N, Infinity);
+        continue;
+      }
+
+      for (auto B : F->getPreds()) {
+        auto O = F->getVExpr(B);
+        if (IsBottom(O)) {
+          G.addEdge(Source, N, GetFrequency(B));
+        } else if (auto OF = dyn_cast<FactorExpression>(O)) {
+          // A real use along the way computes the value whenever the operand
+          // is not available, nothing is ever inserted on such an edge
+          if (F->getHasRealUse(B)) continue;
+
+          // Factors killed during Rename are either replaced by a definition
+          // that is always available or by nothing, then this one is dropped
+          // as well
+          if (!FExprs.count(OF)) {
+            auto S = GetSubstitution(OF);
+            if (IsTop(S) || IsBottom(S)) G.addEdge(Source, N, Infinity);
+            continue;
+          }
+
+          G.addEdge(GetNode(OF), N, GetFrequency(B));
+        }
+      }
+    }
+
+    auto SourceSide = G.solve();
+    for (auto F : Factors) {
+      bool Avail = !SourceSide.test(GetNode(F));
+      F->setCanBeAvail(Avail);
+      F->setLater(false);
+
+      // The insertions for it are speculative, but safe
+      if (Avail) F->setDownSafe(true);
+    }
+  }
+}
+
+void SSAPREContext::
 Finalize() {
   DenseMap<const Expression *, DenseMap<int, Expression *>> AvailDef;
 
@@ -2250,8 +3965,10 @@ Finalize() {
       }
     }
 
+    auto ID = InstrID.lookup(&B->front());
     for (auto &I : *B) {
-      auto VE = InstToVExpr[&I];
+      assert(InstrID.lookup(&I) == ID && "Instruction IDs out of DFS order");
+      auto VE = InstToVExpr[ID++];
       auto PE = ExprToPExpr[VE];
 
       // Traverse operands and add Save count to theirs definitions
@@ -2295,19 +4012,45 @@ Finalize() {
         AddSubstitution(VE, DEF);
       }
     }
+
+    // A real use on the way to an available Factor computes the operand
+    // itself if the operand's Factor is not available or was killed, the
+    // Factor takes it directly
+    for (auto S : successors(B)) {
+      for (auto F : BlockToFactors[S]) {
+        if (!F->getWillBeAvail() || F->getAnyCycles() ||
+            F->getIsMaterialized())
+          continue;
+
+        auto OF = dyn_cast<FactorExpression>(F->getVExpr(B));
+        if (!OF || !F->getHasRealUse(B)) continue;
+        if (FExprs.count(OF) ? OF->getWillBeAvail() || OF->getAnyCycles() ||
+                                   OF->getIsMaterialized()
+                             : !IsTop(GetSubstitution(OF)))
+          continue;
+
+        auto DEF = AvailDef[F->getPExpr()].lookup(OF->getVersion());
+        if (!DEF || FactorExpression::classof(DEF) ||
+            IsBottomOrVarOrConst(DEF) ||
+            !NotStrictlyDominates(DEF, GetVExpr(B->getTerminator())))
+          continue;
+
+        F->setVExpr(B, DEF);
+      }
+    }
   }
 }
 
-bool SSAPRE::
+bool SSAPREContext::
 FactorCleanup(FactorExpression * F) {
   // Quick walk over Factor operands to check if we really need to insert
   // it, it is possible that the operands are all the same.
   Expression * O = nullptr;
   bool Same = true;
   bool HRU = false;
-  for (auto P : F->getVExprs()) {
-    HRU |= F->getHasRealUse(P);
-    auto PS = GetSubstitution(P);
+  for (auto B : F->getPreds()) {
+    HRU |= F->getHasRealUse(B);
+    auto PS = GetSubstitution(F->getVExpr(B));
     if (O && O != PS) {
       Same = false;
       break;
@@ -2334,6 +4077,11 @@ FactorCleanup(FactorExpression * F) {
   for (auto P : F->getPreds()) {
     auto VE = F->getVExpr(P);
     auto SE = GetSubstitution(VE);
+
+    // A real operand whose Factor was dropped stays in place
+    if (IsTop(SE) && !FactorExpression::classof(VE) && !IsTop(VE))
+      SE = VE;
+
     if (IsBottom(SE) || IsTop(SE)) {
       Killed = true;
       break;
@@ -2341,6 +4089,8 @@ FactorCleanup(FactorExpression * F) {
 
     // Save the substitution
     F->setVExpr(P, SE);
+    if (auto SF = dyn_cast<FactorExpression>(SE))
+      FactorUsers[SF].push_back(F);
   }
 
   if (Killed) {
@@ -2362,7 +4112,7 @@ FactorCleanup(FactorExpression * F) {
   return false;
 }
 
-bool SSAPRE::
+bool SSAPREContext::
 FactorGraphWalkBottomUp() {
   bool Changed = false;
 
@@ -2404,7 +4154,7 @@ FactorGraphWalkBottomUp() {
           auto V = FE->getVExpr(P);
 
           if (FE->getIsCycle(V)) {
-            CycledHRU |= FE->getHasRealUse(V);
+            CycledHRU |= FE->getHasRealUse(P);
             CEV.push_back(V);
             continue;
           }
@@ -2450,17 +4200,38 @@ FactorGraphWalkBottomUp() {
           continue; // no further processing
         }
 
+        // Hoisting would keep the value live through the whole cycle
+        if (PressureLimited.count(FE)) {
+          for (auto CE : CEV)  AddSubstitution(CE, CE, /* direct */ true);
+          continue;
+        }
+
+        // With the profile we know whether the cycle is entered often enough
+        // to pay for the computation we insert in front of it
+        if (BFI && IsBottom(VE) &&
+            GetFrequency(PB) >= GetRedundantFrequency(FE)) {
+          for (auto CE : CEV)  AddSubstitution(CE, CE, /* direct */ true);
+          continue;
+        }
+
         // TODO If there is no use of the expression inside the cycle move it
         // TODO to its successors
         auto T = PB->getTerminator();
 
         // Make sure the operands available at the predecessor block end
-        if (!OperandsDominateStrictly(PE->getProto(), InstToVExpr[T])) continue;
+        if (!OperandsDominateStrictly(PE->getProto(), GetVExpr(T))) continue;
+
+        // The cycle may not execute at all, so unless the Factor is DownSafe
+        // a load or a call must not trap when hoisted
+        auto Proto = PE->getProto();
+        if ((isa<LoadInst>(Proto) || isa<CallInst>(Proto)) &&
+            !FE->getDownSafe() &&
+            !isSafeToSpeculativelyExecute(Proto, T, DT)) continue;
 
         // At this point we only the only concern is whether the non-cycled
         // expression exist or not. Even if it is a variable or a const it is
         // not used due to the guard above
-        bool HRU = FE->getHasRealUse(VE);
+        bool HRU = FE->getHasRealUse(PB);
         if (IsBottomOrVarOrConst(VE)) {
           auto I = PE->getProto()->clone();
           VE = CreateExpression(*I);
@@ -2470,6 +4241,7 @@ FactorGraphWalkBottomUp() {
           SetAllOperandsSave(I);
           I->insertBefore(T);
           SSAPREInstrInserted++;
+          ReportInserted(I);
           HRU = false;
         }
 
@@ -2482,21 +4254,34 @@ FactorGraphWalkBottomUp() {
         // already have their operands set
         if (FE->getWillBeAvail() && !FE->getIsMaterialized()) {
           auto PE = (Expression *)FE->getPExpr();
-          for (auto BB : FE->getPreds()) {
+          auto PR = PE->getProto();
+          auto NeedsInsertion = [&](BasicBlock *BB) {
             auto O = FE->getVExpr(BB);
 
             // Satisfies insert if either:
-            if (
+            return
                 // Version(O) is ⊥
                 IsBottom(O) ||
 
                 // HRU(O) is False and O is Factor and WBA(O) is False
-                (!FE->getHasRealUse(O) && FactorExpression::classof(O) &&
-                 !dyn_cast<FactorExpression>(O)->getWillBeAvail())) {
-
-              auto PR = PE->getProto();
-              if (!OperandsDominate(PR, FE)) break;
+                (!FE->getHasRealUse(BB) && FactorExpression::classof(O) &&
+                 !dyn_cast<FactorExpression>(O)->getWillBeAvail());
+          };
+
+          // Either every insertion is possible or none is made and the
+          // Factor is left for the cleanup to drop. The operands must be
+          // available at the end of each block, and a speculated Factor must
+          // not trap there.
+          bool CanInsert = all_of(FE->getPreds(), [&](BasicBlock *BB) {
+            if (!NeedsInsertion(BB)) return true;
+            auto T = BB->getTerminator();
+            return OperandsDominateStrictly(PR, GetVExpr(T)) &&
+                   (!SpeculatedFactors.count(FE) ||
+                    isSafeToSpeculativelyExecute(PR, T, DT));
+          });
 
+          for (auto BB : FE->getPreds()) {
+            if (CanInsert && NeedsInsertion(BB)) {
               auto I = PR->clone();
               auto VE = CreateExpression(*I);
               FE->setVExpr(BB, VE);
@@ -2507,6 +4292,7 @@ FactorGraphWalkBottomUp() {
               SetAllOperandsSave(I);
               I->insertBefore(T);
               SSAPREInstrInserted++;
+              ReportInserted(I);
             }
           }
 
@@ -2526,6 +4312,7 @@ FactorGraphWalkBottomUp() {
           SetAllOperandsSave(I);
           I->insertBefore((Instruction *)T);
           SSAPREInstrInserted++;
+          ReportInserted(I);
 
           ReplaceFactor(FE, VE, /* HRU */ false);
           Changed = true;
@@ -2539,7 +4326,7 @@ FactorGraphWalkBottomUp() {
   return Changed;
 }
 
-bool SSAPRE::
+bool SSAPREContext::
 FactorGraphWalkTopBottom() {
   bool Changed = false;
 
@@ -2555,7 +4342,7 @@ FactorGraphWalkTopBottom() {
   return Changed;
 }
 
-bool SSAPRE::
+bool SSAPREContext::
 PHIInsertion() {
   bool Changed = false;
 
@@ -2577,6 +4364,7 @@ PHIInsertion() {
       PHI->setName("ssapre_phi");
 
       SSAPREPHIInserted++;
+      ReportPHIInserted(PHI, F->getPExpr()->getProto());
 
       // Fill-in PHI operands
       for (auto P : F->getPreds()) {
@@ -2590,8 +4378,8 @@ PHIInsertion() {
           if (!PHIPatches.count(FVE)) PHIPatches.insert({FVE, {}});
           while (REP--) PHIPatches[FVE].push_back({PHI, P});
         } else {
-          auto I = VExprToInst[VE];
-          while (REP--) PHI->addIncoming(I, P);
+          auto V = GetAvailableValue(VE);
+          while (REP--) PHI->addIncoming(V, P);
         }
 
         // Add Save for each operand, since this Factor is live now
@@ -2616,7 +4404,7 @@ PHIInsertion() {
   return Changed;
 }
 
-bool SSAPRE::
+bool SSAPREContext::
 ApplySubstitutions() {
   bool Changed = false;
 
@@ -2641,7 +4429,7 @@ ApplySubstitutions() {
       auto VI = VExprToInst[VE];
       VI->replaceAllUsesWith(T);
       SSAPREInstrSubstituted++;
-      KillList.push_back(VI);
+      AddToKillList(VI);
       continue;
     }
 
@@ -2652,10 +4440,14 @@ ApplySubstitutions() {
     auto VI = VExprToInst[VE];
     auto SE = GetSubstitution(VE);
 
+    // We remove only redundant memory reads, the ones that are merely unused
+    // are left to DCE
+    bool KeepUnused = VI->mayReadFromMemory();
+
     // Top value forces this instruction to stay as is if there are uses
     if (IsTop(SE)) {
       // No uses? GTFO
-      if (!VI->getNumUses()) KillList.push_back(VI);
+      if (!VI->getNumUses() && !KeepUnused) AddToKillList(VI);
       continue;
     }
 
@@ -2663,9 +4455,9 @@ ApplySubstitutions() {
       // Standard case, instruction is not used at all and is not replaced by
       // anything. The only way for instruction to be substituted with a bottom
       // is when its Factor is deleted because of uselessness
-      if (!FactorExpression::classof(VE) && !VE->getSave()) {
+      if (!FactorExpression::classof(VE) && !VE->getSave() && !KeepUnused) {
         assert(AllUsersKilled(VI));
-        KillList.push_back(VI);
+        AddToKillList(VI);
       }
       continue;
     }
@@ -2693,15 +4485,17 @@ ApplySubstitutions() {
       auto DS = GetSubstitution(VE, true);
       DS->remSave();
       if (!DS->getSave() && !IsToBeKilled(DS)) {
-        KillList.push_back(VExprToInst[DS]);
+        AddToKillList(VExprToInst[DS]);
       }
     }
 
-    SE->addSave(RealUses);
+    // A store passes its value operand on, the uses count for that one
+    if (StoreExpression::classof(SE)) SE = ValueToExp.lookup(SI);
+    if (SE) SE->addSave(RealUses);
     VI->replaceAllUsesWith(SI);
     SSAPREInstrSubstituted++;
 
-    KillList.push_back(VI);
+    AddToKillList(VI);
 
     Changed = true;
   }
@@ -2709,7 +4503,7 @@ ApplySubstitutions() {
   return Changed;
 }
 
-bool SSAPRE::
+bool SSAPREContext::
 KillEmAll() {
   bool Changed = false;
 
@@ -2718,7 +4512,9 @@ KillEmAll() {
   // other instructions. For example if we delete the last user of a value and
   // the instruction that produces this value does not have any side effects we
   // can delete it, and so on.
-  for (unsigned i = 0, l = KillList.size(); i < l; ++i) {
+  // N.B. KillList grows while we walk it, and since every instruction is added
+  // only once each one is processed exactly once.
+  for (unsigned i = 0; i < KillList.size(); ++i) {
     auto I = KillList[i];
 
     assert(AllUsersKilled(I) && "Should not be used by live instructions");
@@ -2728,10 +4524,7 @@ KillEmAll() {
       if (auto &OE = ValueToExp[O]) {
         if (IgnoreExpression(OE)) continue;
         OE->remSave();
-        if (!OE->getSave()) {
-          KillList.push_back(VExprToInst[OE]);
-          l++;
-        }
+        if (!OE->getSave()) AddToKillList(VExprToInst[OE]);
       }
     }
 
@@ -2739,17 +4532,11 @@ KillEmAll() {
     I->dropAllReferences();
   }
 
-  // Clear Protos
-  for (auto &P : PExprToInsts) {
-    auto *Proto = P.getFirst()->getProto();
-    if (Proto)
-      Proto->dropAllReferences();
-  }
-
   // Remove instructions completely
   while (!KillList.empty()) {
     auto K = KillList.pop_back_val();
     if (!K->getParent()) continue;
+    ReportDeleted(K);
     K->eraseFromParent();
     if (PHINode::classof(K))
       SSAPREPHIKilled++;
@@ -2761,7 +4548,30 @@ KillEmAll() {
   return Changed;
 }
 
-bool SSAPRE::
+void SSAPREContext::
+ReportInserted(Instruction *I) {
+  using namespace ore;
+  ORE->emit(OptimizationRemark(DEBUG_TYPE, "Inserted", I)
+            << "inserted " << NV("Inst", I) << " of type "
+            << NV("Type", I->getType()));
+}
+
+void SSAPREContext::
+ReportPHIInserted(PHINode *PHI, const Instruction *Proto) {
+  using namespace ore;
+  ORE->emit(OptimizationRemark(DEBUG_TYPE, "PHIInserted", PHI)
+            << "inserted a PHI merging the values of " << NV("Inst", Proto));
+}
+
+void SSAPREContext::
+ReportDeleted(Instruction *I) {
+  using namespace ore;
+  ORE->emit(OptimizationRemark(DEBUG_TYPE, "Deleted", I)
+            << "deleted " << NV("Inst", I) << " of type "
+            << NV("Type", I->getType()));
+}
+
+bool SSAPREContext::
 CodeMotion() {
   bool Changed = false;
 
@@ -2785,7 +4595,7 @@ CodeMotion() {
   return Changed;
 }
 
-void SSAPRE::
+void SSAPREContext::
 PrintDebugInstructions() {
   dbgs() << "\n-Program----------------------------------\n";
 
@@ -2800,12 +4610,12 @@ PrintDebugInstructions() {
   dbgs() << "\n-----------------------------------------\n";
 }
 
-void SSAPRE::
+void SSAPREContext::
 PrintDebugExpressions(bool PrintIgnored) {
   dbgs() << "\n-Expressions-----------------------------\n";
 
   for (auto &P : PExprToInsts) {
-    auto &PE = P.getFirst();
+    auto PE = P.getFirst();
     if (IgnoreExpression(PE)) continue;
     dbgs() << "\n";
     dbgs() << ExpressionTypeToString(PE->getExpressionType());
@@ -2829,7 +4639,7 @@ PrintDebugExpressions(bool PrintIgnored) {
   if (PrintIgnored) {
     dbgs() << "--------\n";
     for (auto &P : PExprToInsts) {
-      auto &PE = P.getFirst();
+      auto PE = P.getFirst();
       if (!IgnoreExpression(PE)) continue;
       dbgs() << "\n";
       dbgs() << ExpressionTypeToString(PE->getExpressionType());
@@ -2853,7 +4663,7 @@ PrintDebugExpressions(bool PrintIgnored) {
   dbgs() << "\n-----------------------------------------\n";
 }
 
-void SSAPRE::
+void SSAPREContext::
 PrintDebugFactors() {
   dbgs() << "\n-BlockToFactors--------------------------\n";
 
@@ -2872,89 +4682,90 @@ PrintDebugFactors() {
   dbgs() << "\n-----------------------------------------\n";
 }
 
-void SSAPRE::
+void SSAPREContext::
 PrintDebugSubstitutions() {
   dbgs() << "\n-Substitutions---------------------------\n";
 
+  // Substitutions are stored flat, so we start a new PE section every time
+  // the prototype changes
   bool UseSeparator = true;
   bool PrintHeader = true;
-  for (auto &PP : Substitutions) {
-    auto PE = PP.getFirst();
-    auto &MA = PP.getSecond();
-
-    if (!MA.size()) continue;
+  const Expression *LastPE = nullptr;
+  for (auto P : Substitutions) {
+    auto VE = (Expression *)P.getFirst();
+    auto VI = VExprToInst.lookup(VE);
+    auto SE = P.getSecond();
+    auto SI = SE ? VExprToInst.lookup(SE) : nullptr;
 
-    for (auto P : MA) {
-      auto VE = P.getFirst();
-      auto VI = VExprToInst[VE];
-      auto SE = P.getSecond();
-      auto SI = VExprToInst[SE];
+    if (!VE) continue;
+    if (IsTop(VE) || IsBottom(VE)) continue;
+    if (IgnoreExpression(VE)) continue;
+    if (VI && !VI->getParent()) continue;
 
-      if (!VE) continue;
-      if (IsTop(VE) || IsBottom(VE)) continue;
-      if (IgnoreExpression(VE)) continue;
-      if (VI && !VI->getParent()) continue;
+    auto PE = ExprToPExpr.lookup(VE);
+    if (!PE) PE = VE;
+    if (PE != LastPE) {
+      if (UseSeparator && !PrintHeader) dbgs() << "\n";
+      PrintHeader = true;
+      LastPE = PE;
+    }
 
-      if (PrintHeader) {
-        dbgs() << "\nPE: " << (void *)PE;
-        PrintHeader = false;
-      }
+    if (PrintHeader) {
+      dbgs() << "\nPE: " << (void *)PE;
+      PrintHeader = false;
+    }
 
-      dbgs() << "\n";
+    dbgs() << "\n";
 
-      if (auto FE = dyn_cast<FactorExpression>(VE)) {
-        if (FE->getIsMaterialized() && FactorToPHI[FE]->getParent()) {
-          dbgs() << "(F)";
-          FactorToPHI[FE]->print(dbgs());
-        } else {
-          dbgs() << "     Factor V: " << FE->getVersion()
-                 << ", MAT: " << (FE->getIsMaterialized() ? "T" : "F")
-                 << ", PE: " << FE->getPExpr();
-        }
-      } else if (VI) {
-        dbgs() << "(I)";
-        VI->print(dbgs());
+    if (auto FE = dyn_cast<FactorExpression>(VE)) {
+      if (FE->getIsMaterialized() && FactorToPHI[FE]->getParent()) {
+        dbgs() << "(F)";
+        FactorToPHI[FE]->print(dbgs());
       } else {
-        llvm_unreachable("Must not be the case");
-      }
-
-      dbgs() << " -> ";
-      if (VE == SE) {
-        dbgs() << "-";
-      } else if (!SE) {
-        dbgs() << "null -- SHOULD NOT BE LIKE THAT";
-      } else if (IsTop(SE)) {
-        dbgs() << "⊤";
-      } else if (IsBottom(SE)) {
-        dbgs() << "⊥";
-      } else if (IsVariableOrConstant(SE)) {
-        ExpToValue[SE]->print(dbgs());
-      } else if (auto FE = dyn_cast<FactorExpression>(SE)) {
-        if (FE->getIsMaterialized() && FactorToPHI[FE]->getParent()) {
-          dbgs() << "(F) ";
-          FactorToPHI[FE]->print(dbgs());
-        } else {
-          dbgs() << "     Factor V: " << FE->getVersion()
-                 << ", MAT: " << (FE->getIsMaterialized() ? "T" : "F")
-                 << ", PE: " << FE->getPExpr();
-        }
-      } else if (!SI->getParent()) {
-        dbgs() << "(deleted)";
-      } else {
-        SI->print(dbgs());
+        dbgs() << "     Factor V: " << FE->getVersion()
+               << ", MAT: " << (FE->getIsMaterialized() ? "T" : "F")
+               << ", PE: " << FE->getPExpr();
       }
+    } else if (VI) {
+      dbgs() << "(I)";
+      VI->print(dbgs());
+    } else {
+      llvm_unreachable("Must not be the case");
     }
 
-    if (UseSeparator && !PrintHeader) {
-      PrintHeader = true;
-      dbgs() << "\n";
+    dbgs() << " -> ";
+    if (VE == SE) {
+      dbgs() << "-";
+    } else if (!SE) {
+      dbgs() << "null -- SHOULD NOT BE LIKE THAT";
+    } else if (IsTop(SE)) {
+      dbgs() << "⊤";
+    } else if (IsBottom(SE)) {
+      dbgs() << "⊥";
+    } else if (IsVariableOrConstant(SE)) {
+      ExpToValue[SE]->print(dbgs());
+    } else if (auto FE = dyn_cast<FactorExpression>(SE)) {
+      if (FE->getIsMaterialized() && FactorToPHI[FE]->getParent()) {
+        dbgs() << "(F) ";
+        FactorToPHI[FE]->print(dbgs());
+      } else {
+        dbgs() << "     Factor V: " << FE->getVersion()
+               << ", MAT: " << (FE->getIsMaterialized() ? "T" : "F")
+               << ", PE: " << FE->getPExpr();
+      }
+    } else if (!SI->getParent()) {
+      dbgs() << "(deleted)";
+    } else {
+      SI->print(dbgs());
     }
   }
 
+  if (UseSeparator && !PrintHeader) dbgs() << "\n";
+
   dbgs() << "\n-----------------------------------------\n";
 }
 
-void SSAPRE::
+void SSAPREContext::
 PrintDebugKillist() {
   dbgs() << "\n-KillList--------------------------------\n";
 
@@ -2970,7 +4781,7 @@ PrintDebugKillist() {
   dbgs() << "\n-----------------------------------------\n";
 }
 
-void SSAPRE::
+void SSAPREContext::
 PrintDebug(const std::string &Caption, PrintInfo PI) {
   dbgs() << "\n" << Caption;
   dbgs() << "\n------------------------------------------------------------\n";
@@ -2982,44 +4793,118 @@ PrintDebug(const std::string &Caption, PrintInfo PI) {
   dbgs() << "\n------------------------------------------------------------\n";
 }
 
-PreservedAnalyses SSAPRE::
+PreservedAnalyses SSAPREContext::
 runImpl(Function &F,
         AssumptionCache &_AC,
-        TargetLibraryInfo &_TLI, DominatorTree &_DT) {
+        TargetLibraryInfo &_TLI, const TargetTransformInfo &_TTI,
+        DominatorTree &_DT, MemorySSA &_MSSA, OptimizationRemarkEmitter &_ORE,
+        BlockFrequencyInfo *_BFI) {
   DEBUG(dbgs() << "SSAPRE(" << this << ") running on " << F.getName());
 
   bool Changed = false;
 
   TLI = &_TLI;
+  TTI = &_TTI;
   DL = &F.getParent()->getDataLayout();
   AC = &_AC;
   DT = &_DT;
+  MSSA = &_MSSA;
+  MSSAWalker = MSSA->getWalker();
+  ORE = &_ORE;
+  BFI = _BFI;
   Func = &F;
 
   NumFuncArgs = F.arg_size();
 
   RPOT = new ReversePostOrderTraversal<Function *>(&F);
+  PeakMemory = 0;
+  PressureWork = 0;
 
   DEBUG(F.dump());
 
-  Init(F);
+  // Over the block budget the dominator tree walk of Rename is all we can
+  // afford, it alone finds the full redundancies
+  FullRedundancyOnly = F.size() > SSAPREMaxBlocks;
+  if (FullRedundancyOnly) {
+    SSAPREOverBudget++;
+    ORE->emit(OptimizationRemarkMissed(DEBUG_TYPE, "TooManyBlocks",
+                                       F.getSubprogram(), &F.getEntryBlock())
+              << "only full redundancies are eliminated, the function has "
+              << ore::NV("Blocks", (unsigned)F.size()) << " blocks, the budget "
+              << "is " << ore::NV("Budget", (unsigned)SSAPREMaxBlocks));
+  }
+
+  if (SSAPREOperandVersioning && !FullRedundancyOnly) {
+    RunPhase("operand-versioning", "OperandVersioning", [&] {
+      Changed |= OperandVersioning();
+      DEBUG(dbgs() << "\nSTEP 0: OperandVersioning\n"; F.dump());
+    });
+  }
+
+  if (SSAPREMemoryVersioning && !FullRedundancyOnly) {
+    RunPhase("memory-versioning", "MemoryVersioning", [&] {
+      Changed |= MemoryVersioning();
+      DEBUG(dbgs() << "\nSTEP 0: MemoryVersioning\n"; F.dump());
+    });
+  }
+
+  if (SSAPREStoreSinking && !FullRedundancyOnly) {
+    RunPhase("store-sinking", "StoreSinking", [&] {
+      Changed |= StoreSinking();
+      DEBUG(dbgs() << "\nSTEP 0.1: StoreSinking\n"; F.dump());
+    });
+  }
+
+  RunPhase("init", "Init", [&] { Init(F); });
+
+  if (!FullRedundancyOnly)
+    RunPhase("factor-insertion", "FactorInsertion", [&] { FactorInsertion(); });
+
+  RunPhase("rename", "Rename", [&] { Rename(); });
 
-  FactorInsertion();
+  RunPhase("down-safety", "DownSafety", [&] {
+    DownSafety();
+    DEBUG(PrintDebug("STEP 3: DownSafety"));
+  });
 
-  Rename();
+  if (SSAPRESpeculate) {
+    RunPhase("speculate", "Speculate", [&] {
+      Speculate();
+      DEBUG(PrintDebug("STEP 3.1: Speculate"));
+    });
+  }
+
+  RunPhase("will-be-avail", "WillBeAvail", [&] {
+    WillBeAvail();
+    DEBUG(PrintDebug("STEP 4: WillBeAvail"));
+  });
+
+  // Without Factors nothing is inserted and no live range grows, the liveness
+  // is not worth computing
+  if (SSAPREPressureAware && !FullRedundancyOnly) {
+    RunPhase("pressure", "LimitRegisterPressure", [&] {
+      LimitRegisterPressure();
+      DEBUG(PrintDebug("STEP 4.1: LimitRegisterPressure"));
+    });
+  }
 
-  DownSafety();
-  DEBUG(PrintDebug("STEP 3: DownSafety"));
+  if (BFI) {
+    RunPhase("min-cut", "MinCutPlacement", [&] {
+      MinCutPlacement();
+      DEBUG(PrintDebug("STEP 4.2: MinCutPlacement"));
+    });
+  }
 
-  WillBeAvail();
-  DEBUG(PrintDebug("STEP 4: WillBeAvail"));
+  RunPhase("finalize", "Finalize", [&] {
+    Finalize();
+    DEBUG(PrintDebug("STEP 5: Finalize"));
+  });
 
-  Finalize();
-  DEBUG(PrintDebug("STEP 5: Finalize"));
+  RunPhase("code-motion", "CodeMotion", [&] { Changed |= CodeMotion(); });
 
-  Changed = CodeMotion();
+  RunPhase("fini", "Fini", [&] { Fini(); });
 
-  Fini();
+  RaisePeakMemory(PeakMemory);
 
   DEBUG(F.dump());
 
@@ -3030,10 +4915,16 @@ runImpl(Function &F,
 }
 
 PreservedAnalyses SSAPRE::run(Function &F, AnalysisManager<Function> &AM) {
-  return runImpl(F,
+  SSAPREContext C;
+  return C.runImpl(F,
       AM.getResult<AssumptionAnalysis>(F),
       AM.getResult<TargetLibraryAnalysis>(F),
-      AM.getResult<DominatorTreeAnalysis>(F));
+      AM.getResult<TargetIRAnalysis>(F),
+      AM.getResult<DominatorTreeAnalysis>(F),
+      AM.getResult<MemorySSAAnalysis>(F).getMSSA(),
+      AM.getResult<OptimizationRemarkEmitterAnalysis>(F),
+      SSAPREProfileGuided ? &AM.getResult<BlockFrequencyAnalysis>(F)
+                          : nullptr);
 }
 
 
@@ -3046,7 +4937,6 @@ class llvm::ssapre::SSAPRELegacy : public FunctionPass {
 
 public:
   static char ID; // Pass identification, replacement for typeid.
-  SSAPRE Impl;
   SSAPRELegacy() : FunctionPass(ID) {
     initializeSSAPRELegacyPass(*PassRegistry::getPassRegistry());
   }
@@ -3059,8 +4949,15 @@ public:
 
     auto &AC = getAnalysis<AssumptionCacheTracker>().getAssumptionCache(F);
     auto &TLI = getAnalysis<TargetLibraryInfoWrapperPass>().getTLI();
+    auto &TTI = getAnalysis<TargetTransformInfoWrapperPass>().getTTI(F);
     auto &DT = getAnalysis<DominatorTreeWrapperPass>().getDomTree();
-    auto PA = Impl.runImpl(F, AC, TLI, DT);
+    auto &MSSA = getAnalysis<MemorySSAWrapperPass>().getMSSA();
+    auto &ORE = getAnalysis<OptimizationRemarkEmitterWrapperPass>().getORE();
+    auto BFI = SSAPREProfileGuided
+      ? &getAnalysis<BlockFrequencyInfoWrapperPass>().getBFI()
+      : nullptr;
+    SSAPREContext C;
+    auto PA = C.runImpl(F, AC, TLI, TTI, DT, MSSA, ORE, BFI);
     return !PA.areAllPreserved();
   }
 
@@ -3068,7 +4965,12 @@ private:
   void getAnalysisUsage(AnalysisUsage &AU) const override {
     AU.addRequired<AssumptionCacheTracker>();
     AU.addRequired<TargetLibraryInfoWrapperPass>();
+    AU.addRequired<TargetTransformInfoWrapperPass>();
     AU.addRequired<DominatorTreeWrapperPass>();
+    AU.addRequired<MemorySSAWrapperPass>();
+    AU.addRequired<OptimizationRemarkEmitterWrapperPass>();
+    if (SSAPREProfileGuided)
+      AU.addRequired<BlockFrequencyInfoWrapperPass>();
   }
 };
 
@@ -3084,7 +4986,11 @@ INITIALIZE_PASS_BEGIN(SSAPRELegacy,
 INITIALIZE_PASS_DEPENDENCY(BreakCriticalEdges)
 INITIALIZE_PASS_DEPENDENCY(AssumptionCacheTracker)
 INITIALIZE_PASS_DEPENDENCY(TargetLibraryInfoWrapperPass)
+INITIALIZE_PASS_DEPENDENCY(TargetTransformInfoWrapperPass)
 INITIALIZE_PASS_DEPENDENCY(DominatorTreeWrapperPass)
+INITIALIZE_PASS_DEPENDENCY(MemorySSAWrapperPass)
+INITIALIZE_PASS_DEPENDENCY(OptimizationRemarkEmitterWrapperPass)
+INITIALIZE_PASS_DEPENDENCY(BlockFrequencyInfoWrapperPass)
 INITIALIZE_PASS_END(SSAPRELegacy,
                     "ssapre",
                     "SSA Partial Redundancy Elimination",
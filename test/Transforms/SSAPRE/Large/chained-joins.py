@@ -0,0 +1,61 @@
+# Test that the Factor graph propagation scales to a long chain of joins.
+# RUN: python %s | opt -ssapre -S | FileCheck %s
+
+# Each link of the chain is a diamond with the expression computed on one side
+# only, this puts a Factor into every join and chains them through their
+# operands:
+#
+#       -------------
+#        c = n == i
+#       -------------
+#          /     \
+#  -------------  -------------
+#   a = x + 1
+#   use a
+#  -------------  -------------
+#          \     /
+#       -------------
+#        c = n == i + 1
+#        ...
+#
+# The expression is anticipated at the end of the chain, so it is inserted
+# into the first diamond only and everything else uses the resulting phi.
+#
+# CHECK-LABEL: @chained_joins(
+# CHECK:       l0:
+# CHECK-NEXT:  %a0 = add i32 %x, 1
+# CHECK:       r0:
+# CHECK-NEXT:  add i32 %x, 1
+# CHECK:       %ssapre_phi = phi i32
+# CHECK-NOT:   add i32
+# CHECK:       ret i32 %ssapre_phi
+import sys
+
+# chained-joins.ll runs a shorter chain on every test run
+count = int(sys.argv[1]) if len(sys.argv) > 1 else 20000
+
+print('declare void @use(i32)')
+print('')
+print('define i32 @chained_joins(i32 %x, i32 %n) {')
+print('entry:')
+print('  br label %bb0')
+
+for i in range(count):
+    print('')
+    print('bb%d:' % i)
+    print('  %%c%d = icmp eq i32 %%n, %d' % (i, i))
+    print('  br i1 %%c%d, label %%l%d, label %%r%d' % (i, i, i))
+    print('')
+    print('l%d:' % i)
+    print('  %%a%d = add i32 %%x, 1' % i)
+    print('  call void @use(i32 %%a%d)' % i)
+    print('  br label %%bb%d' % (i + 1))
+    print('')
+    print('r%d:' % i)
+    print('  br label %%bb%d' % (i + 1))
+
+print('')
+print('bb%d:' % count)
+print('  %res = add i32 %x, 1')
+print('  ret i32 %res')
+print('}')
@@ -0,0 +1,90 @@
+; RUN: opt < %s -ssapre -S | FileCheck %s
+target datalayout = "e-p:64:64:64-p1:16:16:16-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:32:64-f32:32:32-f64:64:64-v64:64:64-v128:128:128-a0:0:64-n8:16:32:64"
+
+declare { i32, i1 } @llvm.sadd.with.overflow.i32(i32, i32)
+
+; Each field of the checked addition is extracted once
+; CHECK-LABEL: @agg_1(
+; CHECK:       %s = call { i32, i1 } @llvm.sadd.with.overflow.i32(i32 %x, i32 %y)
+; CHECK-NEXT:  %v = extractvalue { i32, i1 } %s, 0
+; CHECK-NEXT:  %o = extractvalue { i32, i1 } %s, 1
+; CHECK-NOT:   extractvalue
+; CHECK:       add i32 %v, %v
+define i32 @agg_1(i32 %x, i32 %y) {
+  %s = call { i32, i1 } @llvm.sadd.with.overflow.i32(i32 %x, i32 %y)
+  %v = extractvalue { i32, i1 } %s, 0
+  %o = extractvalue { i32, i1 } %s, 1
+  %w = extractvalue { i32, i1 } %s, 0
+  %r = add i32 %v, %w
+  %z = select i1 %o, i32 0, i32 %r
+  ret i32 %z
+}
+
+; Different fields are different expressions
+; CHECK-LABEL: @agg_2(
+; CHECK:       %a = extractvalue { i32, i32 } %s, 0
+; CHECK-NEXT:  %b = extractvalue { i32, i32 } %s, 1
+; CHECK-NEXT:  add i32 %a, %b
+define i32 @agg_2({ i32, i32 } %s) {
+  %a = extractvalue { i32, i32 } %s, 0
+  %b = extractvalue { i32, i32 } %s, 1
+  %c = add i32 %a, %b
+  ret i32 %c
+}
+
+; The same for the inserts
+; CHECK-LABEL: @agg_3(
+; CHECK:       %a = insertvalue { i32, i32 } %s, i32 %x, 0
+; CHECK-NEXT:  %b = insertvalue { i32, i32 } %s, i32 %x, 1
+; CHECK-NEXT:  %c = insertvalue { i32, i32 } %a, i32 %x, 1
+; CHECK-NEXT:  %e = extractvalue { i32, i32 } %b, 0
+; CHECK-NEXT:  store i32 %e, i32* %p
+; CHECK-NEXT:  ret { i32, i32 } %c
+define { i32, i32 } @agg_3({ i32, i32 } %s, i32 %x, i32* %p) {
+  %a = insertvalue { i32, i32 } %s, i32 %x, 0
+  %b = insertvalue { i32, i32 } %s, i32 %x, 1
+  %d = insertvalue { i32, i32 } %s, i32 %x, 0
+  %c = insertvalue { i32, i32 } %d, i32 %x, 1
+  %e = extractvalue { i32, i32 } %b, 0
+  store i32 %e, i32* %p
+  ret { i32, i32 } %c
+}
+
+; -------------  -------------
+;  %v = ext %s
+;  use %v
+; -------------  -------------
+;          \       /
+;        -------------
+;         %w = ext %s
+;         ret %w
+;        -------------
+; CHECK-LABEL: @agg_4(
+; CHECK:       l:
+; CHECK-NEXT:  %v = extractvalue { i32, i32 } %s, 1
+; CHECK:       r:
+; CHECK-NEXT:  [[R:%.*]] = extractvalue { i32, i32 } %s, 1
+; CHECK:       j:
+; CHECK-NEXT:  %ssapre_phi = phi i32 [ [[R]], %r ], [ %v, %l ]
+; CHECK-NEXT:  ret i32 %ssapre_phi
+define i32 @agg_4(i1 %c, { i32, i32 } %s, i32* %p) {
+entry:
+  br i1 %c, label %l, label %r
+l:
+  %v = extractvalue { i32, i32 } %s, 1
+  store i32 %v, i32* %p
+  br label %j
+r:
+  br label %j
+j:
+  %w = extractvalue { i32, i32 } %s, 1
+  ret i32 %w
+}
+
+; Extracts out of constants fold
+; CHECK-LABEL: @agg_5(
+; CHECK-NEXT:  ret i32 7
+define i32 @agg_5() {
+  %a = extractvalue { i32, i32 } { i32 3, i32 7 }, 1
+  ret i32 %a
+}
@@ -0,0 +1,131 @@
+; RUN: opt < %s -ssapre -S | FileCheck %s
+; RUN: opt < %s -ssapre -ssapre-max-blocks=1 -pass-remarks-missed=ssapre -S \
+; RUN:     2>&1 | FileCheck %s --check-prefix=BLOCKS
+; RUN: opt < %s -ssapre -ssapre-max-factors=1 -pass-remarks-missed=ssapre -S \
+; RUN:     2>&1 | FileCheck %s --check-prefix=FACTORS
+target datalayout = "e-p:64:64:64-p1:16:16:16-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:32:64-f32:32:32-f64:64:64-v64:64:64-v128:128:128-a0:0:64-n8:16:32:64"
+
+; BLOCKS:  remark: <unknown>:0:0: only full redundancies are eliminated, the function has 4 blocks, the budget is 1
+; BLOCKS:  remark: <unknown>:0:0: only full redundancies are eliminated, the function has 7 blocks, the budget is 1
+; FACTORS: remark: <unknown>:0:0: only full redundancies of 1 of 2 expressions are eliminated, the rest fit the budget of {{[0-9]+}} expressions, 1 Factors and a work of {{[0-9]+}}
+; FACTORS: remark: <unknown>:0:0: only full redundancies of 1 of 2 expressions are eliminated, the rest fit the budget of {{[0-9]+}} expressions, 1 Factors and a work of {{[0-9]+}}
+
+; Over the block budget the full redundancy is still eliminated, the partial
+; one is not
+; CHECK-LABEL:  @budget_1(
+; CHECK:        %a = add i32 %x, %y
+; CHECK-NEXT:   %s = mul i32 %a, %a
+; CHECK:        r:
+; CHECK-NEXT:   [[R:%.*]] = sub i32 %x, %y
+; CHECK:        %ssapre_phi = phi i32 [ [[R]], %r ], [ %m, %l ]
+; BLOCKS-LABEL: @budget_1(
+; BLOCKS:       %a = add i32 %x, %y
+; BLOCKS-NEXT:  %s = mul i32 %a, %a
+; BLOCKS:       r:
+; BLOCKS-NEXT:  br label %j
+; BLOCKS:       j:
+; BLOCKS-NEXT:  %n = sub i32 %x, %y
+define i32 @budget_1(i1 %c, i32 %x, i32 %y, i32* %p) {
+entry:
+  %a = add i32 %x, %y
+  %b = add i32 %x, %y
+  %s = mul i32 %a, %b
+  br i1 %c, label %l, label %r
+l:
+  %m = sub i32 %x, %y
+  store i32 %m, i32* %p
+  br label %j
+r:
+  br label %j
+j:
+  %n = sub i32 %x, %y
+  %t = add i32 %s, %n
+  ret i32 %t
+}
+
+; The add comes first and takes the only Factor the budget allows, the mul
+; needs one in both joins and is left out
+; CHECK-LABEL:   @budget_2(
+; CHECK:         r:
+; CHECK-DAG:     add i32 %x, %y
+; CHECK-DAG:     mul i32 %x, %y
+; CHECK:         j2:
+; CHECK-NEXT:    %t = add i32 %ssapre_phi{{1?}}, %ssapre_phi{{1?}}
+; FACTORS-LABEL: @budget_2(
+; FACTORS:       r:
+; FACTORS-NEXT:  add i32 %x, %y
+; FACTORS-NEXT:  br label %j
+; FACTORS:       l2:
+; FACTORS-NEXT:  %m2 = mul i32 %x, %y
+; FACTORS:       j2:
+; FACTORS-NEXT:  %m3 = mul i32 %x, %y
+; FACTORS-NEXT:  %t = add i32 %ssapre_phi, %m3
+define i32 @budget_2(i1 %c, i1 %d, i32 %x, i32 %y, i32* %p) {
+entry:
+  br i1 %c, label %l, label %r
+l:
+  %a = add i32 %x, %y
+  %m = mul i32 %x, %y
+  store i32 %a, i32* %p
+  store i32 %m, i32* %p
+  br label %j
+r:
+  br label %j
+j:
+  %b = add i32 %x, %y
+  br i1 %d, label %l2, label %r2
+l2:
+  %m2 = mul i32 %x, %y
+  store i32 %m2, i32* %p
+  br label %j2
+r2:
+  br label %j2
+j2:
+  %m3 = mul i32 %x, %y
+  %t = add i32 %b, %m3
+  ret i32 %t
+}
+
+; The budget is handed out in the expressions' order, the add takes the only
+; Factor and the mul computed from it is left out. Skipping the mul does not
+; spread to the add, only the other way around would.
+; CHECK-LABEL:   @budget_3(
+; CHECK:         r:
+; CHECK-NEXT:    add i32 %x, %y
+; CHECK:         r2:
+; CHECK-NEXT:    mul i32 %ssapre_phi, %z
+; FACTORS-LABEL: @budget_3(
+; FACTORS:       r:
+; FACTORS-NEXT:  add i32 %x, %y
+; FACTORS-NEXT:  br label %j
+; FACTORS:       r2:
+; FACTORS-NEXT:  br label %j2
+; FACTORS:       j2:
+; FACTORS-NEXT:  %n = mul i32 %ssapre_phi, %z
+define i32 @budget_3(i32 %s, i1 %d, i32 %x, i32 %y, i32 %z, i32* %p) {
+entry:
+  switch i32 %s, label %r [ i32 0, label %l
+                            i32 1, label %l1 ]
+l:
+  %a = add i32 %x, %y
+  store i32 %a, i32* %p
+  br label %j
+l1:
+  %a1 = add i32 %x, %y
+  store i32 %a1, i32* %p
+  br label %j
+r:
+  br label %j
+j:
+  %b = add i32 %x, %y
+  br i1 %d, label %l2, label %r2
+l2:
+  %m = mul i32 %b, %z
+  store i32 %m, i32* %p
+  br label %j2
+r2:
+  br label %j2
+j2:
+  %n = mul i32 %b, %z
+  ret i32 %n
+}
@@ -0,0 +1,87 @@
+; RUN: opt < %s -ssapre -S | FileCheck %s
+target datalayout = "e-p:64:64:64-p1:16:16:16-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:32:64-f32:32:32-f64:64:64-v64:64:64-v128:128:128-a0:0:64-n8:16:32:64"
+
+declare i32 @llvm.ctpop.i32(i32)
+declare double @llvm.sqrt.f64(double)
+declare i64 @strlen(i8*) readonly nounwind
+declare i32 @pure(i32) readnone
+declare void @clobber(i8*)
+
+; Pure intrinsics are the same expression
+; CHECK-LABEL: @call_1(
+; CHECK:       %a = call i32 @llvm.ctpop.i32(i32 %x)
+; CHECK-NOT:   call
+; CHECK:       add i32 %a, %a
+define i32 @call_1(i32 %x) {
+  %a = call i32 @llvm.ctpop.i32(i32 %x)
+  %b = call i32 @llvm.ctpop.i32(i32 %x)
+  %c = add i32 %a, %b
+  ret i32 %c
+}
+
+; Readonly calls observing the same memory state are the same expression
+; CHECK-LABEL: @call_2(
+; CHECK:       %a = call i64 @strlen(i8* %s)
+; CHECK-NOT:   call
+; CHECK:       add i64 %a, %a
+define i64 @call_2(i8* %s) {
+  %a = call i64 @strlen(i8* %s)
+  %b = call i64 @strlen(i8* %s)
+  %c = add i64 %a, %b
+  ret i64 %c
+}
+
+; The memory may change in between
+; CHECK-LABEL: @call_3(
+; CHECK:       %a = call i64 @strlen(i8* %s)
+; CHECK-NEXT:  call void @clobber(i8* %s)
+; CHECK-NEXT:  %b = call i64 @strlen(i8* %s)
+define i64 @call_3(i8* %s) {
+  %a = call i64 @strlen(i8* %s)
+  call void @clobber(i8* %s)
+  %b = call i64 @strlen(i8* %s)
+  %c = add i64 %a, %b
+  ret i64 %c
+}
+
+; A call that may unwind stays where it is
+; CHECK-LABEL: @call_4(
+; CHECK:       %a = call i32 @pure(i32 %x)
+; CHECK-NEXT:  %b = call i32 @pure(i32 %x)
+define i32 @call_4(i32 %x) {
+  %a = call i32 @pure(i32 %x)
+  %b = call i32 @pure(i32 %x)
+  %c = add i32 %a, %b
+  ret i32 %c
+}
+
+; -------------  -------------
+;  %a = sqrt %x
+;  use %a
+; -------------  -------------
+;          \       /
+;        -------------
+;         %b = sqrt %x
+;         ret %b
+;        -------------
+; CHECK-LABEL: @call_5(
+; CHECK:       l:
+; CHECK-NEXT:  %a = call double @llvm.sqrt.f64(double %x)
+; CHECK:       r:
+; CHECK-NEXT:  [[R:%.*]] = call double @llvm.sqrt.f64(double %x)
+; CHECK:       j:
+; CHECK-NEXT:  %ssapre_phi = phi double [ [[R]], %r ], [ %a, %l ]
+; CHECK-NEXT:  ret double %ssapre_phi
+define double @call_5(i1 %c, double %x, double* %p) {
+entry:
+  br i1 %c, label %l, label %r
+l:
+  %a = call double @llvm.sqrt.f64(double %x)
+  store double %a, double* %p
+  br label %j
+r:
+  br label %j
+j:
+  %b = call double @llvm.sqrt.f64(double %x)
+  ret double %b
+}
@@ -0,0 +1,14 @@
+; A shorter run of Large/chained-joins.py that is not skipped without
+; long_tests. A chain of 5000 joins is cheap for the linear propagation, but a
+; recursive walk or a rescan of all the Factors per reset makes it slow or
+; runs it out of stack.
+; RUN: %python %S/Large/chained-joins.py 5000 | opt -ssapre -S | FileCheck %s
+
+; CHECK-LABEL: @chained_joins(
+; CHECK:       l0:
+; CHECK-NEXT:  %a0 = add i32 %x, 1
+; CHECK:       r0:
+; CHECK-NEXT:  add i32 %x, 1
+; CHECK:       %ssapre_phi = phi i32
+; CHECK-NOT:   add i32
+; CHECK:       ret i32 %ssapre_phi
@@ -0,0 +1,130 @@
+; RUN: opt < %s -ssapre -S | FileCheck %s
+target datalayout = "e-p:64:64:64-p1:16:16:16-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:32:64-f32:32:32-f64:64:64-v64:64:64-v128:128:128-a0:0:64-n8:16:32:64"
+
+; Full redundancy
+; CHECK-LABEL: @cmp_1(
+; CHECK:       %a = icmp slt i32 %x, %y
+; CHECK-NOT:   icmp
+; CHECK:       and i1 %a, %a
+define i1 @cmp_1(i32 %x, i32 %y) {
+  %a = icmp slt i32 %x, %y
+  %b = icmp slt i32 %x, %y
+  %c = and i1 %a, %b
+  ret i1 %c
+}
+
+; Swapped operands with the swapped predicate are the same expression
+; CHECK-LABEL: @cmp_2(
+; CHECK:       %a = fcmp olt double %x, %y
+; CHECK-NOT:   fcmp
+; CHECK:       and i1 %a, %a
+define i1 @cmp_2(double %x, double %y) {
+  %a = fcmp olt double %x, %y
+  %b = fcmp ogt double %y, %x
+  %c = and i1 %a, %b
+  ret i1 %c
+}
+
+; -------------  -------------
+;  %a = x < y
+;  use %a
+; -------------  -------------
+;          \       /
+;        -------------
+;         %b = x < y
+;         br %b
+;        -------------
+; CHECK-LABEL: @cmp_3(
+; CHECK:       l:
+; CHECK-NEXT:  %a = icmp ult i32 %x, %y
+; CHECK:       r:
+; CHECK-NEXT:  [[R:%.*]] = icmp ult i32 %x, %y
+; CHECK:       j:
+; CHECK:       %ssapre_phi = phi i1 [ [[R]], %r ], [ %a, %l ]
+; CHECK-NEXT:  br i1 %ssapre_phi, label %t, label %f
+define i32 @cmp_3(i1 %c, i32 %x, i32 %y) {
+entry:
+  br i1 %c, label %l, label %r
+l:
+  %a = icmp ult i32 %x, %y
+  %s = select i1 %a, i32 %x, i32 %y
+  br label %j
+r:
+  br label %j
+j:
+  %v = phi i32 [ %s, %l ], [ 0, %r ]
+  %b = icmp ult i32 %x, %y
+  br i1 %b, label %t, label %f
+t:
+  ret i32 %v
+f:
+  ret i32 0
+}
+
+; Loop invariant compare is hoisted out of the cycle
+; CHECK-LABEL: @cmp_4(
+; CHECK:       entry:
+; CHECK-NEXT:  [[C:%.*]] = icmp eq i32 %x, %y
+; CHECK:       loop:
+; CHECK-NOT:   icmp eq
+; CHECK:       select i1 [[C]]
+define i32 @cmp_4(i32 %x, i32 %y, i32 %n) {
+entry:
+  br label %loop
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %loop ]
+  %acc = phi i32 [ 0, %entry ], [ %acc.next, %loop ]
+  %c = icmp eq i32 %x, %y
+  %d = select i1 %c, i32 %i, i32 1
+  %acc.next = add i32 %acc, %d
+  %i.next = add i32 %i, 1
+  %cmp = icmp slt i32 %i.next, %n
+  br i1 %cmp, label %loop, label %exit
+exit:
+  ret i32 %acc.next
+}
+
+; An existing PHI of the compares is matched with a Factor, both are replaced
+; by a single compare
+; CHECK-LABEL: @cmp_5(
+; CHECK:       l:
+; CHECK-NEXT:  br label %j
+; CHECK:       r:
+; CHECK-NEXT:  br label %j
+; CHECK:       j:
+; CHECK-NEXT:  [[J:%.*]] = icmp ne i32 %{{[xy]}}, %{{[xy]}}
+; CHECK-NEXT:  ret i1 [[J]]
+define i1 @cmp_5(i1 %c, i32 %x, i32 %y) {
+entry:
+  br i1 %c, label %l, label %r
+l:
+  %a = icmp ne i32 %x, %y
+  br label %j
+r:
+  %b = icmp ne i32 %y, %x
+  br label %j
+j:
+  %p = phi i1 [ %a, %l ], [ %b, %r ]
+  ret i1 %p
+}
+
+; The compare folds away and takes the dead chain down to the load, which is
+; replaced by the stored value. The division stays, the store still uses it.
+; CHECK-LABEL: @cmp_6(
+; CHECK:       %div = udiv <4 x i16> %tmp1, %vecinit11
+; CHECK-NEXT:  store <4 x i16> %div, <4 x i16>* %tmp
+; CHECK-NEXT:  ret void
+define void @cmp_6(i16 %conv10) {
+  %tmp = alloca <4 x i16>, align 8
+  %vecinit6 = insertelement <4 x i16> undef, i16 23, i32 3
+  store <4 x i16> %vecinit6, <4 x i16>* undef
+  %tmp1 = load <4 x i16>, <4 x i16>* undef
+  %vecinit11 = insertelement <4 x i16> undef, i16 %conv10, i32 3
+  %div = udiv <4 x i16> %tmp1, %vecinit11
+  store <4 x i16> %div, <4 x i16>* %tmp
+  %tmp4 = load <4 x i16>, <4 x i16>* %tmp
+  %tmp6 = shufflevector <4 x i16> %tmp4, <4 x i16> undef, <2 x i32> <i32 2, i32 0>
+  %cmp = icmp ule <2 x i16> %tmp6, undef
+  %sext = sext <2 x i1> %cmp to <2 x i16>
+  ret void
+}
@@ -0,0 +1,74 @@
+; RUN: opt < %s -ssapre -S | FileCheck %s
+target datalayout = "e-p:64:64:64-p1:16:16:16-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:32:64-f32:32:32-f64:64:64-v64:64:64-v128:128:128-a0:0:64-n8:16:32:64"
+
+; -------------  -------------
+;  %a = x + y
+; -------------  -------------
+;          \       /
+;        -------------
+;         br %d
+;        -------------
+;          /       \
+; -------------  -------------
+;  %b = x + y
+; -------------  -------------
+;          \       /
+;        -------------
+;            ret 0
+;        -------------
+; Both operands of the second join's Factor are the first join's Factor, only
+; the %p1 edge has a real use. The second Factor is not DownSafe and the %p2
+; edge does not compute the expression, so the first Factor is not DownSafe
+; either and nothing is inserted in %r.
+; CHECK-LABEL: @hru_1(
+; CHECK:       r:
+; CHECK-NEXT:  br label %m
+; CHECK:       p1:
+; CHECK-NEXT:  %b = add i32 %x, %y
+define i32 @hru_1(i1 %c, i1 %d, i32 %x, i32 %y, i32* %p) {
+entry:
+  br i1 %c, label %l, label %r
+l:
+  %a = add i32 %x, %y
+  store i32 %a, i32* %p
+  br label %m
+r:
+  br label %m
+m:
+  br i1 %d, label %p1, label %p2
+p1:
+  %b = add i32 %x, %y
+  store i32 %b, i32* %p
+  br label %j
+p2:
+  br label %j
+j:
+  ret i32 0
+}
+
+; The same with the predecessors of the second join in the other order
+; CHECK-LABEL: @hru_2(
+; CHECK:       r:
+; CHECK-NEXT:  br label %m
+; CHECK:       p1:
+; CHECK-NEXT:  %b = add i32 %x, %y
+define i32 @hru_2(i1 %c, i1 %d, i32 %x, i32 %y, i32* %p) {
+entry:
+  br i1 %c, label %l, label %r
+l:
+  %a = add i32 %x, %y
+  store i32 %a, i32* %p
+  br label %m
+r:
+  br label %m
+m:
+  br i1 %d, label %p2, label %p1
+p2:
+  br label %j
+p1:
+  %b = add i32 %x, %y
+  store i32 %b, i32* %p
+  br label %j
+j:
+  ret i32 0
+}
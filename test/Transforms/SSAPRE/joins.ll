@@ -227,3 +227,42 @@ define i32 @join_7(i32) #0 {
   %14 = zext i1 %13 to i32
   ret i32 %14
 }
+
+; Several independent expressions over the same joins, each one is inserted in
+; the predecessor that lacks it
+;
+; CHECK-LABEL: @join_8(
+; CHECK:       r:
+; CHECK-DAG:   add i32 %x, %y
+; CHECK-DAG:   mul i32 %x, %y
+; CHECK-DAG:   xor i32 %x, %z
+; CHECK-DAG:   sub i32 %y, %z
+; CHECK:       j:
+; CHECK-NOT:   add i32 %x, %y
+; CHECK-NOT:   mul i32 %x, %y
+; CHECK:       ret i32
+define i32 @join_8(i1 %c, i32 %x, i32 %y, i32 %z, i32* %p) {
+entry:
+  br i1 %c, label %l, label %r
+l:
+  %a1 = add i32 %x, %y
+  %m1 = mul i32 %x, %y
+  %x1 = xor i32 %x, %z
+  %s1 = sub i32 %y, %z
+  store i32 %a1, i32* %p
+  store i32 %m1, i32* %p
+  store i32 %x1, i32* %p
+  store i32 %s1, i32* %p
+  br label %j
+r:
+  br label %j
+j:
+  %a2 = add i32 %x, %y
+  %m2 = mul i32 %x, %y
+  %x2 = xor i32 %x, %z
+  %s2 = sub i32 %y, %z
+  %t1 = add i32 %a2, %m2
+  %t2 = add i32 %x2, %s2
+  %t3 = add i32 %t1, %t2
+  ret i32 %t3
+}
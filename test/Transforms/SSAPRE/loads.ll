@@ -0,0 +1,331 @@
+; RUN: opt < %s -ssapre -ssapre-memory-versioning -ssapre-store-sinking -S \
+; RUN:     | FileCheck %s
+; RUN: opt < %s -ssapre -ssapre-memory-versioning -ssapre-store-sinking \
+; RUN:     -ssapre-operand-versioning -S | FileCheck %s
+; RUN: opt < %s -ssapre -S | FileCheck %s --check-prefix=DEFAULT
+target datalayout = "e-p:64:64:64-p1:16:16:16-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:32:64-f32:32:32-f64:64:64-v64:64:64-v128:128:128-a0:0:64-n8:16:32:64"
+
+; Loads observing the same memory state are the same expression
+; CHECK-LABEL: @load_1(
+; CHECK:       %a = load i32, i32* %p
+; CHECK-NOT:   load
+; CHECK:       add i32 %a, %a
+define i32 @load_1(i32* %p) {
+  %a = load i32, i32* %p
+  %b = load i32, i32* %p
+  %c = add i32 %a, %b
+  ret i32 %c
+}
+
+; A clobbering store starts a new memory state
+; CHECK-LABEL: @load_2(
+; CHECK:       %a = load i32, i32* %p
+; CHECK:       store i32 %v, i32* %p
+; CHECK-NOT:   load
+; CHECK:       add i32 %a, %v
+define i32 @load_2(i32* %p, i32 %v) {
+  %a = load i32, i32* %p
+  store i32 %v, i32* %p
+  %b = load i32, i32* %p
+  %c = add i32 %a, %b
+  ret i32 %c
+}
+
+; Volatile loads are never touched
+; CHECK-LABEL: @load_3(
+; CHECK:       %a = load volatile i32, i32* %p
+; CHECK:       %b = load volatile i32, i32* %p
+define i32 @load_3(i32* %p) {
+  %a = load volatile i32, i32* %p
+  %b = load volatile i32, i32* %p
+  %c = add i32 %a, %b
+  ret i32 %c
+}
+
+; -------------  -------------
+;  %a = load %p
+;  use %a
+; -------------  -------------
+;          \       /
+;        -------------
+;         %b = load %p
+;         ret %b
+;        -------------
+; CHECK-LABEL: @load_4(
+; CHECK:       l:
+; CHECK:       %a = load i32, i32* %p
+; CHECK:       r:
+; CHECK-NEXT:  [[L:%.*]] = load i32, i32* %p
+; CHECK:       j:
+; CHECK-NEXT:  %ssapre_phi = phi i32 [ [[L]], %r ], [ %a, %l ]
+; CHECK-NEXT:  ret i32 %ssapre_phi
+define i32 @load_4(i1 %c, i32* %p) {
+entry:
+  br i1 %c, label %l, label %r
+l:
+  %a = load i32, i32* %p
+  %a1 = add i32 %a, 1
+  br label %j
+r:
+  br label %j
+j:
+  %b = load i32, i32* %p
+  ret i32 %b
+}
+
+; -------------  -------------
+;  %a = load %p   store %p
+;  use %a
+; -------------  -------------
+;          \       /
+;        -------------
+;         %b = load %p
+;         ret %b
+;        -------------
+; The memory states differ, but the Factor at the join's MemoryPhi versions the
+; load: it is the stored value on one side and the load on the other
+; CHECK-LABEL: @load_5(
+; CHECK:       r:
+; CHECK-NEXT:  store
+; CHECK-NEXT:  br
+; CHECK:       j:
+; CHECK-NEXT:  %ssapre_phi = phi i32 [ %v, %r ], [ %a, %l ]
+; CHECK-NEXT:  ret i32 %ssapre_phi
+; DEFAULT-LABEL: @load_5(
+; DEFAULT:       r:
+; DEFAULT-NEXT:  store
+; DEFAULT-NEXT:  br
+; DEFAULT:       j:
+; DEFAULT-NEXT:  %ssapre_phi = phi i32 [ %v, %r ], [ %a, %l ]
+; DEFAULT-NEXT:  ret i32 %ssapre_phi
+define i32 @load_5(i1 %c, i32* %p, i32 %v) {
+entry:
+  br i1 %c, label %l, label %r
+l:
+  %a = load i32, i32* %p
+  %a1 = add i32 %a, 1
+  br label %j
+r:
+  store i32 %v, i32* %p
+  br label %j
+j:
+  %b = load i32, i32* %p
+  ret i32 %b
+}
+
+; Loop invariant load is hoisted out of the cycle
+; CHECK-LABEL: @load_6(
+; CHECK:       entry:
+; CHECK-NEXT:  [[L:%.*]] = load i32, i32* %p
+; CHECK:       loop:
+; CHECK-NOT:   load
+; CHECK:       add i32 %acc, [[L]]
+; CHECK:       exit:
+define i32 @load_6(i32* %p, i32 %n) {
+entry:
+  br label %loop
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %latch ]
+  %acc = phi i32 [ 0, %entry ], [ %acc.next, %latch ]
+  %v = load i32, i32* %p
+  %acc.next = add i32 %acc, %v
+  %i.next = add i32 %i, 1
+  %cmp = icmp slt i32 %i.next, %n
+  br i1 %cmp, label %latch, label %exit
+latch:
+  br label %loop
+exit:
+  ret i32 %acc.next
+}
+
+; The cycle stores to the same address. The header reads it on every
+; iteration, so the load of the first one goes in front of the cycle and the
+; stored value comes around the back edge.
+; CHECK-LABEL: @load_7(
+; CHECK:       entry:
+; CHECK-NEXT:  [[L:%.*]] = load i32, i32* %p
+; CHECK:       loop:
+; CHECK-NEXT:  %i = phi
+; CHECK-NEXT:  %acc = phi
+; CHECK-NEXT:  [[V:%.*]] = phi i32 [ %i, %latch ], [ [[L]], %entry ]
+; CHECK-NOT:   load
+; CHECK:       %acc.next = add i32 %acc, [[V]]
+; CHECK:       latch:
+; CHECK-NEXT:  store i32 %i, i32* %p
+define i32 @load_7(i32* %p, i32 %n) {
+entry:
+  br label %loop
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %latch ]
+  %acc = phi i32 [ 0, %entry ], [ %acc.next, %latch ]
+  %v = load i32, i32* %p
+  %acc.next = add i32 %acc, %v
+  %i.next = add i32 %i, 1
+  %cmp = icmp slt i32 %i.next, %n
+  br i1 %cmp, label %latch, label %exit
+latch:
+  store i32 %i, i32* %p
+  br label %loop
+exit:
+  ret i32 %acc.next
+}
+
+; The cycle stores the loaded value back. The load is versioned by the
+; MemoryPhi of the cycle: on entry it is the load before the cycle, on the
+; back edge it is the stored value. The store is sunk only on request.
+; CHECK-LABEL: @load_8(
+; CHECK:       entry:
+; CHECK-NEXT:  %v0 = load i32, i32* %p
+; CHECK:       loop:
+; CHECK-NEXT:  [[V:%.*]] = phi i32 [ %v.next, %loop ], [ %v0, %entry ]
+; CHECK-NOT:   load
+; CHECK:       %v.next = add i32 [[V]], %i
+; CHECK-NOT:   store
+; CHECK:       exit:
+; CHECK-NEXT:  store i32 %v.next, i32* %p
+; DEFAULT-LABEL: @load_8(
+; DEFAULT:       loop:
+; DEFAULT:       [[V:%.*]] = phi i32 [ %v.next, %loop ], [ %v0, %entry ]
+; DEFAULT-NOT:   load
+; DEFAULT:       %v.next = add i32 [[V]], %i
+; DEFAULT-NEXT:  store i32 %v.next, i32* %p
+define i32 @load_8(i32* %p, i32 %n) {
+entry:
+  %v0 = load i32, i32* %p
+  br label %loop
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %loop ]
+  %v = load i32, i32* %p
+  %v.next = add i32 %v, %i
+  store i32 %v.next, i32* %p
+  %i.next = add i32 %i, 1
+  %cmp = icmp slt i32 %i.next, %n
+  br i1 %cmp, label %loop, label %exit
+exit:
+  ret i32 %v0
+}
+
+; Same as load_7 with an address that can be read anywhere
+; CHECK-LABEL: @load_9(
+; CHECK:       entry:
+; CHECK-NEXT:  [[L:%.*]] = load i32, i32* %p
+; CHECK:       loop:
+; CHECK-NEXT:  [[V:%.*]] = phi i32 [ %i, %latch ], [ [[L]], %entry ]
+; CHECK-NOT:   load
+; CHECK:       %acc.next = add i32 %acc, [[V]]
+; CHECK:       latch:
+; CHECK-NEXT:  store i32 %i, i32* %p
+define i32 @load_9(i32* dereferenceable(4) %p, i32 %n) {
+entry:
+  br label %loop
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %latch ]
+  %acc = phi i32 [ 0, %entry ], [ %acc.next, %latch ]
+  %v = load i32, i32* %p
+  %acc.next = add i32 %acc, %v
+  %i.next = add i32 %i, 1
+  %cmp = icmp slt i32 %i.next, %n
+  br i1 %cmp, label %latch, label %exit
+latch:
+  store i32 %i, i32* %p
+  br label %loop
+exit:
+  ret i32 %acc.next
+}
+
+; Only one of the back edges writes the address, along the other one the
+; value read on the previous iteration flows around the cycle
+; CHECK-LABEL: @load_10(
+; CHECK:       loop:
+; CHECK-NEXT:  [[V:%.*]] = phi i32 [ %w, %latch2 ], [ [[V]], %latch1 ], [ %v, %entry ]
+; CHECK-NOT:   load
+; CHECK:       %acc.next = add i32 %acc, [[V]]
+define i32 @load_10(i32* %p, i32 %v, i32 %w, i32 %n) {
+entry:
+  store i32 %v, i32* %p
+  br label %loop
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %latch1 ], [ %i.next, %latch2 ]
+  %acc = phi i32 [ 0, %entry ], [ %acc.next, %latch1 ], [ %acc.next, %latch2 ]
+  %x = load i32, i32* %p
+  %acc.next = add i32 %acc, %x
+  %i.next = add i32 %i, 1
+  %cmp = icmp slt i32 %i.next, %n
+  br i1 %cmp, label %body, label %exit
+body:
+  %odd = and i32 %i, 1
+  %c = icmp eq i32 %odd, 0
+  br i1 %c, label %latch1, label %latch2
+latch1:
+  br label %loop
+latch2:
+  store i32 %w, i32* %p
+  br label %loop
+exit:
+  ret i32 %acc.next
+}
+
+; A store to another address that may alias %p clobbers it just the same
+; CHECK-LABEL: @load_11(
+; CHECK:       %a = load i32, i32* %p
+; CHECK:       store i32 %v, i32* %q
+; CHECK:       %b = load i32, i32* %p
+; CHECK:       add i32 %a, %b
+define i32 @load_11(i32* %p, i32* %q, i32 %v) {
+  %a = load i32, i32* %p
+  store i32 %v, i32* %q
+  %b = load i32, i32* %p
+  %c = add i32 %a, %b
+  ret i32 %c
+}
+
+; A may-alias store on one side of the diamond makes the load after the join
+; only partially redundant, it is inserted after the store
+; CHECK-LABEL: @load_12(
+; CHECK:       entry:
+; CHECK-NEXT:  %a = load i32, i32* %p
+; CHECK:       store i32 %v, i32* %q
+; CHECK-NEXT:  [[L:%[0-9]+]] = load i32, i32* %p
+; CHECK:       [[V:%[a-z0-9_.]+]] = phi i32 [ %a, %r ], [ [[L]], %l ]
+; CHECK-NEXT:  add i32 %a, [[V]]
+define i32 @load_12(i1 %c, i32* %p, i32* %q, i32 %v) {
+entry:
+  %a = load i32, i32* %p
+  br i1 %c, label %l, label %r
+l:
+  store i32 %v, i32* %q
+  br label %j
+r:
+  br label %j
+j:
+  %b = load i32, i32* %p
+  %s = add i32 %a, %b
+  ret i32 %s
+}
+
+; The PHI of the loads is not a Factor of the load after the join, the store
+; in %l clobbers %a, its value is the stored one
+; CHECK-LABEL: @load_13(
+; CHECK:       %a = load i32, i32* %p
+; CHECK-NEXT:  store i32 %w, i32* %p
+; CHECK:       %b = load i32, i32* %p
+; CHECK-NOT:   load
+; CHECK-DAG:   %m = phi i32 [ %a, %l ], [ %b, %r ]
+; CHECK-DAG:   [[V:%[a-z0-9_.]+]] = phi i32 [ %b, %r ], [ %w, %l ]
+; CHECK:       add i32 %m, [[V]]
+define i32 @load_13(i1 %c, i32* %p, i32 %w) {
+entry:
+  br i1 %c, label %l, label %r
+l:
+  %a = load i32, i32* %p
+  store i32 %w, i32* %p
+  br label %j
+r:
+  %b = load i32, i32* %p
+  br label %j
+j:
+  %m = phi i32 [ %a, %l ], [ %b, %r ]
+  %d = load i32, i32* %p
+  %s = add i32 %m, %d
+  ret i32 %s
+}
@@ -0,0 +1,126 @@
+; RUN: opt < %s -ssapre -ssapre-operand-versioning -S | FileCheck %s
+; RUN: opt < %s -ssapre -S | FileCheck %s --check-prefix=DEFAULT
+target datalayout = "e-p:64:64:64-p1:16:16:16-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:32:64-f32:32:32-f64:64:64-v64:64:64-v128:128:128-a0:0:64-n8:16:32:64"
+
+; -------------  -------------
+;  %a1 = x + 1    %a2 = y + 1
+; -------------  -------------
+;          \       /
+;        -------------
+;         %a = phi(x, y)
+;         %b = a + 1
+;        -------------
+; Both translations of %b are available
+; CHECK-LABEL: @ov_1(
+; CHECK:       j:
+; CHECK-NEXT:  %ssapre_phi = phi i32 [ %a2, %r ], [ %a1, %l ]
+; CHECK-NEXT:  ret i32 %ssapre_phi
+; The step is off by default, the expression over the PHI stays
+; DEFAULT-LABEL: @ov_1(
+; DEFAULT:       j:
+; DEFAULT-NEXT:  %a = phi i32 [ %x, %l ], [ %y, %r ]
+; DEFAULT-NEXT:  %b = add i32 %a, 1
+define i32 @ov_1(i1 %c, i32 %x, i32 %y, i32* %p) {
+entry:
+  br i1 %c, label %l, label %r
+l:
+  %a1 = add i32 %x, 1
+  store i32 %a1, i32* %p
+  br label %j
+r:
+  %a2 = add i32 %y, 1
+  store i32 %a2, i32* %p
+  br label %j
+j:
+  %a = phi i32 [ %x, %l ], [ %y, %r ]
+  %b = add i32 %a, 1
+  ret i32 %b
+}
+
+; Only one translation is available, the other one is inserted
+; CHECK-LABEL: @ov_2(
+; CHECK:       r:
+; CHECK-NEXT:  [[R:%.*]] = mul i32 7, %y
+; CHECK-NEXT:  br label %j
+; CHECK:       j:
+; CHECK-NEXT:  %ssapre_phi = phi i32 [ [[R]], %r ], [ %a1, %l ]
+; CHECK-NEXT:  ret i32 %ssapre_phi
+define i32 @ov_2(i1 %c, i32 %x, i32 %y, i32* %p) {
+entry:
+  br i1 %c, label %l, label %r
+l:
+  %a1 = mul i32 %x, %y
+  store i32 %a1, i32* %p
+  br label %j
+r:
+  br label %j
+j:
+  %a = phi i32 [ %x, %l ], [ 7, %r ]
+  %b = mul i32 %a, %y
+  ret i32 %b
+}
+
+; Same, but the division may trap in the predecessor
+; CHECK-LABEL: @ov_3(
+; CHECK:       r:
+; CHECK-NEXT:  br label %j
+; CHECK:       j:
+; CHECK-NEXT:  %a = phi i32 [ %x, %l ], [ 0, %r ]
+; CHECK-NEXT:  %b = sdiv i32 %y, %a
+define i32 @ov_3(i1 %c, i32 %x, i32 %y, i32* %p) {
+entry:
+  br i1 %c, label %l, label %r
+l:
+  %a1 = sdiv i32 %y, %x
+  store i32 %a1, i32* %p
+  br label %j
+r:
+  br label %j
+j:
+  %a = phi i32 [ %x, %l ], [ 0, %r ]
+  %b = sdiv i32 %y, %a
+  ret i32 %b
+}
+
+; Nothing is available, nothing changes
+; CHECK-LABEL: @ov_4(
+; CHECK:       j:
+; CHECK-NEXT:  %a = phi i32 [ %x, %l ], [ %y, %r ]
+; CHECK-NEXT:  %b = add i32 %a, 1
+define i32 @ov_4(i1 %c, i32 %x, i32 %y, i32* %p) {
+entry:
+  br i1 %c, label %l, label %r
+l:
+  br label %j
+r:
+  br label %j
+j:
+  %a = phi i32 [ %x, %l ], [ %y, %r ]
+  %b = add i32 %a, 1
+  ret i32 %b
+}
+
+; The flags of the reused occurrences are dropped
+; CHECK-LABEL: @ov_5(
+; CHECK:       l:
+; CHECK-NEXT:  %a1 = add i32 %x, 1
+; CHECK:       r:
+; CHECK-NEXT:  %a2 = add i32 %y, 1
+; CHECK:       j:
+; CHECK-NEXT:  %ssapre_phi = phi i32 [ %a2, %r ], [ %a1, %l ]
+define i32 @ov_5(i1 %c, i32 %x, i32 %y, i32* %p) {
+entry:
+  br i1 %c, label %l, label %r
+l:
+  %a1 = add nsw i32 %x, 1
+  store i32 %a1, i32* %p
+  br label %j
+r:
+  %a2 = add nuw i32 %y, 1
+  store i32 %a2, i32* %p
+  br label %j
+j:
+  %a = phi i32 [ %x, %l ], [ %y, %r ]
+  %b = add i32 %a, 1
+  ret i32 %b
+}
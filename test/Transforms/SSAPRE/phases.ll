@@ -0,0 +1,45 @@
+; RUN: opt < %s -ssapre -ssapre-operand-versioning \
+; RUN:     -ssapre-memory-versioning -ssapre-store-sinking -ssapre-pressure-aware \
+; RUN:     -ssapre-report-phases -disable-output 2>&1 | FileCheck %s
+; RUN: opt < %s -ssapre -ssapre-operand-versioning \
+; RUN:     -ssapre-memory-versioning -ssapre-store-sinking -ssapre-pressure-aware \
+; RUN:     -time-passes -disable-output 2>&1 | FileCheck %s --check-prefix=TIME
+target datalayout = "e-p:64:64:64-p1:16:16:16-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:32:64-f32:32:32-f64:64:64-v64:64:64-v128:128:128-a0:0:64-n8:16:32:64"
+
+; Every step reports the memory it leaves behind
+; CHECK:      SSAPRE phases_1 after OperandVersioning: expressions {{[0-9]+}} B
+; CHECK-NEXT: SSAPRE phases_1 after MemoryVersioning: expressions {{[0-9]+}} B
+; CHECK-NEXT: SSAPRE phases_1 after StoreSinking: expressions {{[0-9]+}} B
+; CHECK-NEXT: SSAPRE phases_1 after Init: expressions {{[0-9]+}} B, values {{[0-9]+}} B, PEs {{[0-9]+}} B, Factors {{[0-9]+}} B, substitutions {{[0-9]+}} B; 5 PEs, 0 Factors
+; CHECK-NEXT: SSAPRE phases_1 after FactorInsertion: {{.*}}; 5 PEs, 1 Factors
+; CHECK-NEXT: SSAPRE phases_1 after Rename:
+; CHECK-NEXT: SSAPRE phases_1 after DownSafety:
+; CHECK-NEXT: SSAPRE phases_1 after WillBeAvail:
+; CHECK-NEXT: SSAPRE phases_1 after LimitRegisterPressure:
+; CHECK-NEXT: SSAPRE phases_1 after Finalize:
+; CHECK-NEXT: SSAPRE phases_1 after CodeMotion:
+; CHECK-NEXT: SSAPRE phases_1 after Fini: {{.*}}; 0 PEs, 0 Factors, 0 killed
+
+; TIME:       SSA Partial Redundancy Elimination
+; TIME-DAG:   OperandVersioning
+; TIME-DAG:   MemoryVersioning
+; TIME-DAG:   StoreSinking
+; TIME-DAG:   Init
+; TIME-DAG:   FactorInsertion
+; TIME-DAG:   Rename
+; TIME-DAG:   DownSafety
+; TIME-DAG:   WillBeAvail
+; TIME-DAG:   Finalize
+; TIME-DAG:   CodeMotion
+define i32 @phases_1(i1 %c, i32 %x, i32 %y) {
+entry:
+  br i1 %c, label %l, label %r
+l:
+  %a = add i32 %x, %y
+  br label %j
+r:
+  br label %j
+j:
+  %b = add i32 %x, %y
+  ret i32 %b
+}
@@ -0,0 +1,100 @@
+; RUN: opt < %s -ssapre -ssapre-pressure-aware -S | FileCheck %s
+; RUN: opt < %s -ssapre -S | FileCheck %s --check-prefix=NOLIMIT
+; RUN: opt < %s -ssapre -ssapre-pressure-aware -ssapre-max-pressure-work=1 \
+; RUN:     -pass-remarks-missed=ssapre -S 2>&1 | \
+; RUN:     FileCheck %s --check-prefixes=BUDGET,NOLIMIT
+target datalayout = "e-p:64:64:64-p1:16:16:16-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:32:64-f32:32:32-f64:64:64-v64:64:64-v128:128:128-a0:0:64-n8:16:32:64"
+
+; BUDGET: remark: <unknown>:0:0: register pressure is not limited, estimating it exceeds the work budget of 1
+
+; Few values are live in the cycle, the invariant is hoisted
+; CHECK-LABEL: @pressure_1(
+; CHECK:       entry:
+; CHECK-NEXT:  [[M:%.*]] = mul i32 %x, %y
+; CHECK:       loop:
+; CHECK-NOT:   mul
+; CHECK:       %acc.next = add i32 %acc, [[M]]
+define i32 @pressure_1(i32 %x, i32 %y, i32 %n) {
+entry:
+  br label %loop
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %loop ]
+  %acc = phi i32 [ 0, %entry ], [ %acc.next, %loop ]
+  %v = mul i32 %x, %y
+  %acc.next = add i32 %acc, %v
+  %i.next = add i32 %i, 1
+  %cmp = icmp slt i32 %i.next, %n
+  br i1 %cmp, label %loop, label %exit
+exit:
+  ret i32 %acc.next
+}
+
+; The cycle already uses all the registers the default target has, hoisting
+; the invariant would need one more through the whole cycle. Over the budget of
+; the estimate nothing is limited.
+; CHECK-LABEL:   @pressure_2(
+; CHECK:         entry:
+; CHECK-NEXT:    br label %loop
+; CHECK:         loop:
+; CHECK:         %v = mul i32 %x, %y
+; NOLIMIT-LABEL: @pressure_2(
+; NOLIMIT:       entry:
+; NOLIMIT-NEXT:  [[M:%.*]] = mul i32 %x, %y
+; NOLIMIT:       loop:
+; NOLIMIT-NOT:   mul
+; NOLIMIT:       %s0 = add i32 %acc, [[M]]
+define i32 @pressure_2(i32 %x, i32 %y, i32 %n, i32 %a0, i32 %a1, i32 %a2,
+                        i32 %a3, i32 %a4) {
+entry:
+  br label %loop
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %loop ]
+  %acc = phi i32 [ 0, %entry ], [ %acc.next, %loop ]
+  %v = mul i32 %x, %y
+  %s0 = add i32 %acc, %v
+  %s1 = add i32 %s0, %a0
+  %s2 = add i32 %s1, %a1
+  %s3 = add i32 %s2, %a2
+  %s4 = add i32 %s3, %a3
+  %s5 = add i32 %s4, %a4
+  %s6 = add i32 %s5, %x
+  %acc.next = add i32 %s6, %y
+  %i.next = add i32 %i, 1
+  %cmp = icmp slt i32 %i.next, %n
+  br i1 %cmp, label %loop, label %exit
+exit:
+  ret i32 %acc.next
+}
+
+; The integer registers are all taken in the cycle, the floating point ones
+; are not, so the floating point invariant is still hoisted
+; CHECK-LABEL: @pressure_3(
+; CHECK:       entry:
+; CHECK-NEXT:  [[M:%.*]] = fmul float %f, %g
+; CHECK:       loop:
+; CHECK-NOT:   fmul
+; CHECK:       %facc.next = fadd float %facc, [[M]]
+define i32 @pressure_3(i32 %x, i32 %y, i32 %n, i32 %a0, i32 %a1, i32 %a2,
+                        i32 %a3, i32 %a4, float %f, float %g, float* %p) {
+entry:
+  br label %loop
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %loop ]
+  %acc = phi i32 [ 0, %entry ], [ %acc.next, %loop ]
+  %facc = phi float [ 0.0, %entry ], [ %facc.next, %loop ]
+  %v = fmul float %f, %g
+  %facc.next = fadd float %facc, %v
+  %s1 = add i32 %acc, %a0
+  %s2 = add i32 %s1, %a1
+  %s3 = add i32 %s2, %a2
+  %s4 = add i32 %s3, %a3
+  %s5 = add i32 %s4, %a4
+  %s6 = add i32 %s5, %x
+  %acc.next = add i32 %s6, %y
+  %i.next = add i32 %i, 1
+  %cmp = icmp slt i32 %i.next, %n
+  br i1 %cmp, label %loop, label %exit
+exit:
+  store float %facc.next, float* %p
+  ret i32 %acc.next
+}
@@ -0,0 +1,189 @@
+; RUN: opt < %s -ssapre -S | FileCheck %s
+; RUN: opt < %s -ssapre -ssapre-profile-guided -S | FileCheck %s --check-prefix=PROF
+target datalayout = "e-p:64:64:64-p1:16:16:16-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:32:64-f32:32:32-f64:64:64-v64:64:64-v128:128:128-a0:0:64-n8:16:32:64"
+
+;        -------------
+;         br %c (r is hot)
+;        -------------
+;          /       \
+; -------------  -------------
+;  %a = x + y
+; -------------  -------------
+;          \       /
+;        -------------
+;         br %d (u is cold)
+;        -------------
+;          /       \
+; -------------  -------------
+;  %b = x + y
+; -------------  -------------
+; The Factor in the first join is not DownSafe, the path to %exit does not
+; compute the expression. The min-cut may speculate it, but the insertion in
+; the hot %r costs more than the partially redundant %b saves, so it keeps the
+; expression where it is as well.
+; CHECK-LABEL: @prof_1(
+; CHECK:       r:
+; CHECK-NEXT:  br label %j
+; CHECK:       u:
+; CHECK-NEXT:  %b = add i32 %x, %y
+; PROF-LABEL:  @prof_1(
+; PROF:        r:
+; PROF-NEXT:   br label %j
+; PROF:        u:
+; PROF-NEXT:   %b = add i32 %x, %y
+define i32 @prof_1(i1 %c, i1 %d, i32 %x, i32 %y, i32* %p) {
+entry:
+  br i1 %c, label %l, label %r, !prof !0
+l:
+  %a = add i32 %x, %y
+  store i32 %a, i32* %p
+  br label %j
+r:
+  br label %j
+j:
+  br i1 %d, label %u, label %exit, !prof !0
+u:
+  %b = add i32 %x, %y
+  store i32 %b, i32* %p
+  br label %exit
+exit:
+  ret i32 0
+}
+
+; The loop is almost never entered, do not hoist out of it
+; CHECK-LABEL: @prof_2(
+; CHECK:       entry:
+; CHECK-NEXT:  [[M:%.*]] = mul i32 %x, %y
+; CHECK:       loop:
+; CHECK-NOT:   mul
+; CHECK:       %acc.next = add i32 %acc, [[M]]
+; PROF-LABEL:  @prof_2(
+; PROF:        entry:
+; PROF-NEXT:   br i1 %c
+; PROF:        loop:
+; PROF:        %v = mul i32 %x, %y
+; PROF-NEXT:   %acc.next = add i32 %acc, %v
+define i32 @prof_2(i1 %c, i32 %x, i32 %y, i32 %n) {
+entry:
+  br i1 %c, label %loop, label %exit, !prof !1
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %loop ]
+  %acc = phi i32 [ 0, %entry ], [ %acc.next, %loop ]
+  %v = mul i32 %x, %y
+  %acc.next = add i32 %acc, %v
+  %i.next = add i32 %i, 1
+  %cmp = icmp slt i32 %i.next, %n
+  br i1 %cmp, label %loop, label %exit
+exit:
+  %r = phi i32 [ 0, %entry ], [ %acc.next, %loop ]
+  ret i32 %r
+}
+
+;        -------------
+;         br %c (l is hot)
+;        -------------
+;          /       \
+;         |   -------------
+;         |    %a = x + y
+;         |    br %e (j1 is cold)
+;         |   -------------
+;          \       /
+;        -------------
+;         br %d (m is hot)
+;        -------------
+;          /       \
+; -------------  -------------
+;                 %b = x + y
+; -------------  -------------
+;          \       /
+;        -------------
+;         %s = x + y
+;        -------------
+; The first join is not worth an insertion in the entry block, but the second
+; one is: %b computes the value on its own edge regardless of the first
+; Factor, so only the cold %n needs an insertion
+; PROF-LABEL:  @prof_3(
+; PROF:        entry:
+; PROF-NEXT:   br i1 %c
+; PROF:        m:
+; PROF-NEXT:   %b = add i32 %x, %y
+; PROF:        n:
+; PROF-NEXT:   [[N:%.*]] = add i32 %x, %y
+; PROF:        j2:
+; PROF-NEXT:   [[S:%.*]] = phi i32 [ [[N]], %n ], [ %b, %m ]
+; PROF-NEXT:   ret i32 [[S]]
+define i32 @prof_3(i1 %c, i1 %d, i1 %e, i32 %x, i32 %y, i32* %p) {
+entry:
+  br i1 %c, label %j1, label %l, !prof !0
+l:
+  %a = add i32 %x, %y
+  store i32 %a, i32* %p
+  br i1 %e, label %j1, label %exit, !prof !0
+j1:
+  br i1 %d, label %n, label %m, !prof !0
+m:
+  %b = add i32 %x, %y
+  store i32 %b, i32* %p
+  br label %j2
+n:
+  br label %j2
+j2:
+  %s = add i32 %x, %y
+  ret i32 %s
+exit:
+  ret i32 0
+}
+
+;        -------------
+;         br %c (r is cold)
+;        -------------
+;          /       \
+; -------------  -------------
+;  %a = x + y
+; -------------  -------------
+;          \       /
+;        -------------
+;         br %d (u is hot)
+;        -------------
+;          /       \
+; -------------  -------------
+;  %b = x + y
+; -------------  -------------
+; The same as @prof_1 with the weights swapped. The Factor in the first join is
+; still not DownSafe, but now the insertion in the cold %r is cheaper than
+; computing %b on the hot path, so the min-cut speculates it.
+; CHECK-LABEL: @prof_4(
+; CHECK:       r:
+; CHECK-NEXT:  br label %j
+; CHECK:       u:
+; CHECK-NEXT:  %b = add i32 %x, %y
+; PROF-LABEL:  @prof_4(
+; PROF:        r:
+; PROF-NEXT:   [[R:%.*]] = add i32 %x, %y
+; PROF-NEXT:   br label %j
+; PROF:        j:
+; PROF-NEXT:   %ssapre_phi = phi i32 [ [[R]], %r ], [ %a, %l ]
+; PROF:        u:
+; PROF-NEXT:   store i32 %ssapre_phi, i32* %p
+define i32 @prof_4(i1 %c, i1 %d, i32 %x, i32 %y, i32* %p) {
+entry:
+  br i1 %c, label %l, label %r, !prof !2
+l:
+  %a = add i32 %x, %y
+  store i32 %a, i32* %p
+  br label %j
+r:
+  br label %j
+j:
+  br i1 %d, label %u, label %exit, !prof !2
+u:
+  %b = add i32 %x, %y
+  store i32 %b, i32* %p
+  br label %exit
+exit:
+  ret i32 0
+}
+
+!0 = !{!"branch_weights", i32 1, i32 1000}
+!1 = !{!"branch_weights", i32 1, i32 100000}
+!2 = !{!"branch_weights", i32 1000, i32 1}
@@ -0,0 +1,68 @@
+; RUN: opt < %s -ssapre -pass-remarks=ssapre -disable-output 2>&1 | FileCheck %s
+; RUN: opt < %s -ssapre -pass-remarks-output=%t -pass-remarks-with-hotness \
+; RUN:     -disable-output
+; RUN: cat %t | FileCheck %s --check-prefix=YAML
+target datalayout = "e-p:64:64:64-p1:16:16:16-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:32:64-f32:32:32-f64:64:64-v64:64:64-v128:128:128-a0:0:64-n8:16:32:64"
+
+; -------------  -------------
+;  %a = x + y
+;  use %a
+; -------------  -------------
+;          \       /
+;        -------------
+;         %b = x + y
+;         ret %b
+;        -------------
+; CHECK:      remark: <unknown>:0:0: inserted add of type i32
+; CHECK-NEXT: remark: <unknown>:0:0: inserted a PHI merging the values of add
+; CHECK-NEXT: remark: <unknown>:0:0: deleted add of type i32
+; CHECK-NOT:  remark:
+
+; The clone goes to the cold side, the PHI and the deletion are in the join
+; YAML:      --- !Passed
+; YAML-NEXT: Pass:            ssapre
+; YAML-NEXT: Name:            Inserted
+; YAML-NEXT: Function:        remark_1
+; YAML-NEXT: Hotness:         10
+; YAML-NEXT: Args:
+; YAML-NEXT:   - String:          'inserted '
+; YAML-NEXT:   - Inst:            add
+; YAML-NEXT:   - String:          ' of type '
+; YAML-NEXT:   - Type:            i32
+; YAML-NEXT: ...
+; YAML-NEXT: --- !Passed
+; YAML-NEXT: Pass:            ssapre
+; YAML-NEXT: Name:            PHIInserted
+; YAML-NEXT: Function:        remark_1
+; YAML-NEXT: Hotness:         100
+; YAML-NEXT: Args:
+; YAML-NEXT:   - String:          'inserted a PHI merging the values of '
+; YAML-NEXT:   - Inst:            add
+; YAML-NEXT: ...
+; YAML-NEXT: --- !Passed
+; YAML-NEXT: Pass:            ssapre
+; YAML-NEXT: Name:            Deleted
+; YAML-NEXT: Function:        remark_1
+; YAML-NEXT: Hotness:         100
+; YAML-NEXT: Args:
+; YAML-NEXT:   - String:          'deleted '
+; YAML-NEXT:   - Inst:            add
+; YAML-NEXT:   - String:          ' of type '
+; YAML-NEXT:   - Type:            i32
+; YAML-NEXT: ...
+define i32 @remark_1(i1 %c, i32 %x, i32 %y, i32* %p) !prof !0 {
+entry:
+  br i1 %c, label %l, label %r, !prof !1
+l:
+  %a = add i32 %x, %y
+  store i32 %a, i32* %p
+  br label %j
+r:
+  br label %j
+j:
+  %b = add i32 %x, %y
+  ret i32 %b
+}
+
+!0 = !{!"function_entry_count", i64 100}
+!1 = !{!"branch_weights", i32 90, i32 10}
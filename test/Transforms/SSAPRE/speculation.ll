@@ -0,0 +1,78 @@
+; RUN: opt < %s -ssapre -S | FileCheck %s
+; RUN: opt < %s -ssapre -ssapre-speculate -S | FileCheck %s --check-prefix=SPEC
+; RUN: opt < %s -ssapre -ssapre-speculate -ssapre-speculation-threshold=0 -S | FileCheck %s
+target datalayout = "e-p:64:64:64-p1:16:16:16-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:32:64-f32:32:32-f64:64:64-v64:64:64-v128:128:128-a0:0:64-n8:16:32:64"
+
+; -------------  -------------
+;  %a = x + y
+;  use %a
+; -------------  -------------
+;          \       /
+;        -------------
+;         br %d
+;        -------------
+;          /       \
+; -------------  -------------
+;  %b = x + y     ret 0
+;  ret %b
+; -------------  -------------
+; The join is not DownSafe, but an add is cheap and cannot trap
+; CHECK-LABEL: @spec_1(
+; CHECK:       r:
+; CHECK-NEXT:  br label %j
+; CHECK:       u:
+; CHECK-NEXT:  %b = add i32 %x, %y
+; CHECK-NEXT:  ret i32 %b
+; SPEC-LABEL:  @spec_1(
+; SPEC:        r:
+; SPEC-NEXT:   [[R:%.*]] = add i32 %x, %y
+; SPEC:        j:
+; SPEC-NEXT:   %ssapre_phi = phi i32 [ [[R]], %r ], [ %a, %l ]
+; SPEC:        u:
+; SPEC-NEXT:   ret i32 %ssapre_phi
+define i32 @spec_1(i1 %c, i1 %d, i32 %x, i32 %y, i32* %p) {
+entry:
+  br i1 %c, label %l, label %r
+l:
+  %a = add i32 %x, %y
+  store i32 %a, i32* %p
+  br label %j
+r:
+  br label %j
+j:
+  br i1 %d, label %u, label %exit
+u:
+  %b = add i32 %x, %y
+  ret i32 %b
+exit:
+  ret i32 0
+}
+
+; Same as above, but the division may trap
+; CHECK-LABEL: @spec_2(
+; CHECK:       r:
+; CHECK-NEXT:  br label %j
+; CHECK:       u:
+; CHECK-NEXT:  %b = sdiv i32 %x, %y
+; SPEC-LABEL:  @spec_2(
+; SPEC:        r:
+; SPEC-NEXT:   br label %j
+; SPEC:        u:
+; SPEC-NEXT:   %b = sdiv i32 %x, %y
+define i32 @spec_2(i1 %c, i1 %d, i32 %x, i32 %y, i32* %p) {
+entry:
+  br i1 %c, label %l, label %r
+l:
+  %a = sdiv i32 %x, %y
+  store i32 %a, i32* %p
+  br label %j
+r:
+  br label %j
+j:
+  br i1 %d, label %u, label %exit
+u:
+  %b = sdiv i32 %x, %y
+  ret i32 %b
+exit:
+  ret i32 0
+}
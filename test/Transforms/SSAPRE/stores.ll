@@ -0,0 +1,319 @@
+; RUN: opt < %s -ssapre -ssapre-memory-versioning -ssapre-store-sinking -S \
+; RUN:     | FileCheck %s
+; RUN: opt < %s -ssapre -S | FileCheck %s --check-prefix=DEFAULT
+target datalayout = "e-p:64:64:64-p1:16:16:16-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:32:64-f32:32:32-f64:64:64-v64:64:64-v128:128:128-a0:0:64-n8:16:32:64"
+
+; The stored value is available to the load it clobbers
+; CHECK-LABEL: @store_1(
+; CHECK:       store i32 %v, i32* %p
+; CHECK-NOT:   load
+; CHECK:       ret i32 %v
+define i32 @store_1(i32* %p, i32 %v) {
+  store i32 %v, i32* %p
+  %a = load i32, i32* %p
+  ret i32 %a
+}
+
+; A store to a different, possibly aliasing, address does not define %p
+; CHECK-LABEL: @store_2(
+; CHECK:       store i32 %v, i32* %q
+; CHECK-NEXT:  %a = load i32, i32* %p
+; CHECK-NEXT:  ret i32 %a
+define i32 @store_2(i32* %p, i32* %q, i32 %v) {
+  store i32 %v, i32* %q
+  %a = load i32, i32* %p
+  ret i32 %a
+}
+
+; Volatile stores do not define anything
+; CHECK-LABEL: @store_3(
+; CHECK:       store volatile i32 %v, i32* %p
+; CHECK-NEXT:  %a = load i32, i32* %p
+; CHECK-NEXT:  ret i32 %a
+define i32 @store_3(i32* %p, i32 %v) {
+  store volatile i32 %v, i32* %p
+  %a = load i32, i32* %p
+  ret i32 %a
+}
+
+; The stored value is forwarded after it has been substituted itself
+; CHECK-LABEL: @store_4(
+; CHECK:       %a = add i32 %x, %y
+; CHECK-NEXT:  store i32 %a, i32* %p
+; CHECK-NEXT:  %c = mul i32 %a, %a
+; CHECK-NEXT:  ret i32 %c
+define i32 @store_4(i32* %p, i32 %x, i32 %y) {
+  %a = add i32 %x, %y
+  %b = add i32 %x, %y
+  store i32 %b, i32* %p
+  %l = load i32, i32* %p
+  %c = mul i32 %a, %l
+  ret i32 %c
+}
+
+;        -------------
+;         store %v, %p
+;        -------------
+;          /       \
+; -------------  -------------
+;  %a = load %p
+;  use %a
+; -------------  -------------
+;          \       /
+;        -------------
+;         %b = load %p
+;         ret %b
+;        -------------
+; CHECK-LABEL: @store_5(
+; CHECK:       entry:
+; CHECK-NEXT:  store i32 %v, i32* %p
+; CHECK-NOT:   load
+; CHECK:       ret i32 %v
+define i32 @store_5(i1 %c, i32* %p, i32 %v) {
+entry:
+  store i32 %v, i32* %p
+  br i1 %c, label %l, label %r
+l:
+  %a = load i32, i32* %p
+  %a1 = add i32 %a, 1
+  br label %j
+r:
+  br label %j
+j:
+  %b = load i32, i32* %p
+  ret i32 %b
+}
+
+; Store to load forwarding inside a cycle, nothing else reads the store and
+; it sinks to the exit
+; CHECK-LABEL: @store_6(
+; CHECK:       loop:
+; CHECK-NOT:   load
+; CHECK-NOT:   store
+; CHECK:       %acc.next = add i32 %acc, %i
+; CHECK:       exit:
+; CHECK-NEXT:  store i32 %i, i32* %p
+; The sinking is off by default, the store stays in the cycle
+; DEFAULT-LABEL: @store_6(
+; DEFAULT:       loop:
+; DEFAULT:       store i32 %i, i32* %p
+; DEFAULT:       exit:
+; DEFAULT-NEXT:  ret i32
+define i32 @store_6(i32* %p, i32 %n) {
+entry:
+  br label %loop
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %loop ]
+  %acc = phi i32 [ 0, %entry ], [ %acc.next, %loop ]
+  store i32 %i, i32* %p
+  %v = load i32, i32* %p
+  %acc.next = add i32 %acc, %v
+  %i.next = add i32 %i, 1
+  %cmp = icmp slt i32 %i.next, %n
+  br i1 %cmp, label %loop, label %exit
+exit:
+  ret i32 %acc.next
+}
+
+; Two exits and a store on either side of a diamond, neither store dominates
+; the exits but one of them executes on every path into them
+; CHECK-LABEL: @store_7(
+; CHECK:       join:
+; CHECK-NEXT:  [[V:%.*]] = phi i32 [ %x, %pos ], [ %i, %neg ]
+; CHECK-NOT:   store
+; CHECK:       exit1:
+; CHECK-NEXT:  store i32 [[V]], i32* %p
+; CHECK:       exit2:
+; CHECK-NEXT:  store i32 [[V]], i32* %p
+define void @store_7(i32* noalias %p, i32* noalias %a, i32 %n) {
+entry:
+  br label %loop
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %latch ]
+  %gep = getelementptr i32, i32* %a, i32 %i
+  %x = load i32, i32* %gep
+  %c = icmp slt i32 %x, 0
+  br i1 %c, label %neg, label %pos
+neg:
+  store i32 %i, i32* %p
+  br label %join
+pos:
+  store i32 %x, i32* %p
+  br label %join
+join:
+  %z = icmp eq i32 %x, 0
+  br i1 %z, label %exit1, label %latch
+latch:
+  %i.next = add i32 %i, 1
+  %cmp = icmp slt i32 %i.next, %n
+  br i1 %cmp, label %loop, label %exit2
+exit1:
+  ret void
+exit2:
+  ret void
+}
+
+; The first iteration may leave before the store, sinking would store to %p
+; on a path that does not
+; CHECK-LABEL: @store_8(
+; CHECK:       latch:
+; CHECK-NEXT:  store i32 %x, i32* %p
+; CHECK:       exit1:
+; CHECK-NEXT:  ret void
+; CHECK:       exit2:
+; CHECK-NEXT:  ret void
+define void @store_8(i32* noalias %p, i32* noalias %a, i32 %n) {
+entry:
+  br label %loop
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %latch ]
+  %gep = getelementptr i32, i32* %a, i32 %i
+  %x = load i32, i32* %gep
+  %z = icmp eq i32 %x, 0
+  br i1 %z, label %exit1, label %latch
+latch:
+  store i32 %x, i32* %p
+  %i.next = add i32 %i, 1
+  %cmp = icmp slt i32 %i.next, %n
+  br i1 %cmp, label %loop, label %exit2
+exit1:
+  ret void
+exit2:
+  ret void
+}
+
+; The same for a local no one else sees, the early exit stores back the value
+; from before the loop, which is read in the preheader and forwarded from the
+; store there
+; CHECK-LABEL: @store_9(
+; CHECK:       loop:
+; CHECK-NEXT:  [[V:%.*]] = phi i32 [ %x, %latch ], [ %s0, %entry ]
+; CHECK:       latch:
+; CHECK-NOT:   store
+; CHECK:       exit1:
+; CHECK-NEXT:  store i32 [[V]], i32* %p
+; CHECK:       exit2:
+; CHECK-NEXT:  store i32 %x, i32* %p
+define i32 @store_9(i32* noalias %a, i32 %n, i32* %s) {
+entry:
+  %p = alloca i32
+  %s0 = load i32, i32* %s
+  store i32 %s0, i32* %p
+  br label %loop
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %latch ]
+  %gep = getelementptr i32, i32* %a, i32 %i
+  %x = load i32, i32* %gep
+  %z = icmp eq i32 %x, 0
+  br i1 %z, label %exit1, label %latch
+latch:
+  store i32 %x, i32* %p
+  %i.next = add i32 %i, 1
+  %cmp = icmp slt i32 %i.next, %n
+  br i1 %cmp, label %loop, label %exit2
+exit1:
+  %r1 = load i32, i32* %p
+  ret i32 %r1
+exit2:
+  %r2 = load i32, i32* %p
+  ret i32 %r2
+}
+
+declare void @store_use(i32)
+
+; The call may read %p
+; CHECK-LABEL: @store_10(
+; CHECK:       loop:
+; CHECK:       store i32 %i, i32* %p
+; CHECK-NEXT:  call void @store_use(i32 %i)
+; CHECK:       exit:
+; CHECK-NEXT:  ret void
+define void @store_10(i32* %p, i32 %n) {
+entry:
+  br label %loop
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %loop ]
+  store i32 %i, i32* %p
+  call void @store_use(i32 %i)
+  %i.next = add i32 %i, 1
+  %cmp = icmp slt i32 %i.next, %n
+  br i1 %cmp, label %loop, label %exit
+exit:
+  ret void
+}
+
+; The inner loop's store goes to its exit first and from there out of the
+; outer loop as well
+; CHECK-LABEL: @store_11(
+; CHECK-NOT:   store
+; CHECK:       exit:
+; CHECK-NEXT:  store i32 %s, i32* %p
+define void @store_11(i32* %p, i32 %n, i32 %m) {
+entry:
+  br label %outer
+outer:
+  %j = phi i32 [ 0, %entry ], [ %j.next, %outer.latch ]
+  br label %inner
+inner:
+  %i = phi i32 [ 0, %outer ], [ %i.next, %inner ]
+  %s = add i32 %i, %j
+  store i32 %s, i32* %p
+  %i.next = add i32 %i, 1
+  %c = icmp slt i32 %i.next, %n
+  br i1 %c, label %inner, label %outer.latch
+outer.latch:
+  %j.next = add i32 %j, 1
+  %c2 = icmp slt i32 %j.next, %m
+  br i1 %c2, label %outer, label %exit
+exit:
+  ret void
+}
+
+declare i32 @store_f(i32) readnone
+
+; The readnone call does not touch memory but may unwind, the caller must see
+; the store of the iteration it unwinds in
+; CHECK-LABEL: @store_12(
+; CHECK:       loop:
+; CHECK:       store i32 %i, i32* %p
+; CHECK-NEXT:  call i32 @store_f(i32 %i)
+; CHECK:       exit:
+; CHECK-NEXT:  ret void
+define void @store_12(i32* %p, i32 %n) {
+entry:
+  br label %loop
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %loop ]
+  store i32 %i, i32* %p
+  %r = call i32 @store_f(i32 %i) readnone
+  %i.next = add i32 %i, %r
+  %cmp = icmp slt i32 %i.next, %n
+  br i1 %cmp, label %loop, label %exit
+exit:
+  ret void
+}
+
+; Only the store without alignment has the ABI one, the sunk store may not
+; claim more than the other store's
+; CHECK-LABEL: @store_13(
+; CHECK:       exit:
+; CHECK-NEXT:  store i32 [[V:%.*]], i32* %p, align 1
+define void @store_13(i1 %c, i32* %p, i32 %n) {
+entry:
+  br label %loop
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %latch ]
+  br i1 %c, label %l, label %r
+l:
+  store i32 %i, i32* %p
+  br label %latch
+r:
+  store i32 %n, i32* %p, align 1
+  br label %latch
+latch:
+  %i.next = add i32 %i, 1
+  %cmp = icmp slt i32 %i.next, %n
+  br i1 %cmp, label %loop, label %exit
+exit:
+  ret void
+}